@@ -18,6 +18,7 @@
  */
 
 #include "hub.h"
+#include "log_ring.h"
 #include <linux/delay.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
@@ -27,8 +28,8 @@
 #define VERBOSITY 1
 
 #if VERBOSITY
-#define PRINTKD(fmt, args...) if (debug) { printk( fmt , ## args) ; }
-#define PRINTKI(fmt, args...) if (info) { printk( fmt , ## args) ; }
+#define PRINTKD(fmt, args...) if (debug) { LOG_RING( fmt , ## args) ; }
+#define PRINTKI(fmt, args...) if (info) { LOG_RING( fmt , ## args) ; }
 #else
 #define PRINTKD(fmt, args...)
 #define PRINTKI(fmt, args...)
@@ -36,14 +37,16 @@
 
 static int machine_state;
 static int hub_interrupt_queued = 0;
-static unsigned long start_time;
+static ost_stamp_t start_time;
+
+/* us since the first UDC interrupt, for the [%lu] prefix of every trace line */
+#define NOW_US()	ost_ticks_to_us(ost_stamp() - start_time)
 static int currentPort = 0;
 /* The address of all ports (0 == hub) */
 static u8 portAddress[7];
 static u16 port_status[6] = { 0, 0, 0, 0, 0, 0 };
 static u16 port_change[6] = { 0, 0, 0, 0, 0, 0 };
 static int switch_to_port_delayed = -1;
-static void * port_changed_buf;
 
 static int debug = 0;
 static int info = 1;
@@ -51,6 +54,7 @@ static int addr_delay = 300;
 static int port_delay = 200;
 static int eventa = 0;
 static int eventd = 0;
+static int sm_hop_us = 1000;
 static int device_retry = 0;
 static int expected_port_reset = 0;
 /*
@@ -143,7 +147,7 @@ static void switch_to_port (unsigned int port)
 	
 	currentPort = port;
 	sa1100_set_address (portAddress[port]);
-	PRINTKI( "[%lu]Switching to port %d. Address is %d (UDCAR=%d)\n", (jiffies-start_time)*10, port, portAddress[port], Ser0UDCAR);
+	PRINTKI( "[%lu]Switching to port %d. Address is %d (UDCAR=%d)\n", NOW_US(), port, portAddress[port], Ser0UDCAR);
 	if (addr_delay)
 		udelay(addr_delay);
 }
@@ -156,7 +160,7 @@ static void hub_connect_port (unsigned int port)
 	
 	expected_port_reset = port;
 	
-	//PRINTKD( "[%lu]Hub: Connect port %d\n", (jiffies-start_time)*10, port );
+	//PRINTKD( "[%lu]Hub: Connect port %d\n", NOW_US(), port );
 	switch_to_port (0);
 
 	/* Here, we must enable the port directly, otherwise we might loose time
@@ -170,6 +174,14 @@ static void hub_connect_port (unsigned int port)
 	hub_port_changed ();
 }
 
+/*
+ * Only one status change notification is outstanding at a time. Changes
+ * that come up while it waits for the host to poll EP2 are OR-ed into
+ * hub_status_pending and go out as a single byte when it completes,
+ * rebuilt from port_change[] so bits the host already cleared drop out.
+ */
+static u8 hub_status_pending;
+
 static void hub_port_changed ()
 {
 	u8 data = 0;
@@ -184,22 +196,40 @@ static void hub_port_changed ()
 	}
 
 	if (data != 0) {
+		struct usb_txbuf *b;
 		int err = 0;
 
 		if (hub_interrupt_queued) {
-			printk("[%lu]hub_interrupt_transmit: Already queued a request\n", (jiffies-start_time)*10);
+			if (hub_status_pending)
+				usbd_info.stats.hub_notify_merged++;
+			else
+				usbd_info.stats.hub_notify_deferred++;
+			hub_status_pending |= data;
+			PRINTKI("[%lu]hub_interrupt_transmit: merged 0x%X, pending 0x%X\n", NOW_US(), data,
+				hub_status_pending);
 			return;
 		}
-		PRINTKI( "[%lu]Hub:Transmitting interrupt byte 0x%X\n", (jiffies-start_time)*10, data);
-		hub_interrupt_queued = 1;
-		memcpy (port_changed_buf, &data, 1);
+		hub_status_pending = 0;
+		usbd_info.stats.hub_notify_sent++;
+		if (j > 1)
+			usbd_info.stats.hub_notify_multi++;
+		PRINTKI( "[%lu]Hub:Transmitting interrupt byte 0x%X\n", NOW_US(), data);
+		hub_interrupt_queued++;
+		b = sa1100_usb_txbuf_get();
+		if (!b) {
+			printk("[%lu]hub_interrupt_transmit: no tx buffer\n", NOW_US());
+			hub_interrupt_queued--;
+			return;
+		}
+		b->data[0] = data;
 		// Half delay before send
 		if (port_delay)
 			udelay(port_delay);
 			
-		err = sa1100_usb_send(port_changed_buf, 1, hub_interrupt_complete);
+		err = sa1100_usb_send_buf(b, 1, hub_interrupt_complete);
 		if (err) {
 			printk( "hub_port_changed .send_retcode %d\n", err);
+			hub_interrupt_queued--;
 		}
 		// Unmask EP2 interrupts
 		Ser0UDCCR = 0;
@@ -208,27 +238,23 @@ static void hub_port_changed ()
 		if (port_delay)
 			udelay(port_delay);
 	} else {
+		hub_status_pending = 0;
 		if (hub_interrupt_queued)	{
 			printk( "hub_interrupt_transmit: pendiente usb_ep_dequeue\n");
 		}
 	}
-
-	// OJO
-	if (j>1) {
-		printk("[%lu]hub_interrupt_transmit: Se estropeo\n", (jiffies-start_time)*10);
-		info = 0;
-	}
 }
 
 static void hub_interrupt_complete(int flag, int size) {
 	int flags;
 	
-	PRINTKI( "[%lu]Hub_interrupt_complete (status %d)\n",(jiffies-start_time)*10, flag);
+	PRINTKI( "[%lu]Hub_interrupt_complete (status %d)\n",NOW_US(), flag);
 	local_irq_save(flags);	
+	if (hub_interrupt_queued > 0)
+		hub_interrupt_queued--;
 	if (flag == 0)
 	{
 		//printk( "hub_interrupt_complete: queda pendiente?\n");
-		hub_interrupt_queued = 0;
 	}
 	else
 	{
@@ -237,25 +263,36 @@ static void hub_interrupt_complete(int flag, int size) {
 		
 	local_irq_restore(flags);
 
+	// The next notification is already on its way, leave EP2 unmasked
+	if (hub_interrupt_queued)
+		return;
+
+	// Changes merged while we waited for the host go out now, in one byte
+	if (hub_status_pending) {
+		hub_port_changed();
+		if (hub_interrupt_queued)
+			return;
+	}
+
 	// Mask EP2 interrupts
 	Ser0UDCCR = 0xFC;
 	UDC_write(Ser0UDCCR, UDCCR_TIM);
 	//UDC_write(Ser0UDCCR, UDCCR_TIM | UDCCR_REM); // Errata 29
 	
 	if (device_retry>0) {
-		PRINTKI( "[%lu]GetHub/PortStatus: retry port %d \n", (jiffies-start_time)*10, device_retry);
+		PRINTKI( "[%lu]GetHub/PortStatus: retry port %d \n", NOW_US(), device_retry);
 	}
 	
 	// Keep sending Device 5 connected until PORT_RESET received
 	if (machine_state==DEVICE5_WAIT_READY && device_retry>0) {
 		machine_state=DEVICE4_READY;
-		SET_TIMER (10);
+		SET_TIMER_HOP ();
 	}
 	
 	// Keep sending Device 3 disconnected until PORT_STATUS received
 	if (machine_state==DEVICE3_WAIT_DISCONNECT && device_retry>0) {
 		machine_state=DEVICE5_READY;
-		SET_TIMER (10);
+		SET_TIMER_HOP ();
 	}
 }
 
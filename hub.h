@@ -17,8 +17,8 @@
 #ifndef __LINUX_USB_HUB_H
 #define __LINUX_USB_HUB_H
 
-#include <linux/timer.h>
 #include <linux/types.h>
+#include "os_timer.h"
 
 /* 11.23.2.1  Class-Specific AC Interface Descriptor */
 typedef struct {
@@ -32,10 +32,13 @@ typedef struct {
 	__u8  PortPwrCtrlMask;		/* [n/8] */
 } __attribute__ ((packed)) usb_hub_header_descriptor;
 
-static struct timer_list state_machine_timer;
-#define msecs_to_jiffies(ms) (((ms)*HZ+999)/1000)
-#define SET_TIMER(ms)  PRINTKI( "[%lu]Setting timer to %d ms\n", (jiffies-start_time)*10, ms );  \
-mod_timer (&state_machine_timer, jiffies + msecs_to_jiffies(ms))
+/* state machine steps run off the OS timer, see os_timer.c */
+static struct ost_event state_machine_event;
+#define SET_TIMER(ms)  PRINTKI( "[%lu]Setting timer to %d ms\n", NOW_US(), ms );  \
+ost_add (&state_machine_event, (ms) * 1000)
+/* a hop just moves to the next state, as soon as the host can see it */
+#define SET_TIMER_HOP()  PRINTKI( "[%lu]Setting timer to %d us\n", NOW_US(), sm_hop_us );  \
+ost_add (&state_machine_event, sm_hop_us)
 
 #define USB_DT_HUB_HEADER_SIZE(n)	(sizeof(struct usb_hub_header_descriptor))
 #define USB_DT_CS_HUB 0x29
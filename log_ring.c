@@ -0,0 +1,118 @@
+/*
+ * log_ring.c -- deferred logging for the UDC interrupt path
+ *
+ * This software is distributed under the terms of the GNU General Public
+ * License ("GPL") version 3, as published by the Free Software Foundation.
+ *
+ * Single consumer ring: any context may add records (interrupts are only
+ * held off for the few stores that fill a slot), the psjbipaqlogd thread
+ * is the only one taking them out. When the ring is full new records are
+ * dropped and counted rather than blocking the producer.
+ */
+
+#include <linux/sched.h>
+#include <linux/smp_lock.h>
+#include <linux/string.h>
+#include <asm/system.h>
+#include "log_ring.h"
+
+static struct log_rec log_ring[LOG_RING_SIZE];
+static volatile unsigned int log_head;	/* next slot to fill */
+static volatile unsigned int log_tail;	/* next slot to print */
+static unsigned long log_dropped;
+static unsigned long log_max_lag;	/* us between logging and printing */
+
+static DECLARE_WAIT_QUEUE_HEAD(log_wait);
+static DECLARE_COMPLETION(log_thread_exited);
+static int log_thread_pid = -1;
+static volatile int log_thread_stop;
+
+static void log_ring_put(const char *fmt, int nargs, ...)
+{
+	struct log_rec *rec;
+	va_list ap;
+	int flags;
+	int i;
+
+	local_irq_save(flags);
+	if (log_head - log_tail >= LOG_RING_SIZE) {
+		log_dropped++;
+		local_irq_restore(flags);
+		return;
+	}
+
+	rec = &log_ring[log_head & (LOG_RING_SIZE - 1)];
+	rec->ts = ost_stamp();
+	rec->fmt = fmt;
+	va_start(ap, nargs);
+	for (i = 0; i < nargs && i < LOG_MAX_ARGS; i++)
+		rec->args[i] = va_arg(ap, unsigned long);
+	va_end(ap);
+
+	wmb();
+	log_head++;
+	local_irq_restore(flags);
+}
+
+static void log_ring_drain(void)
+{
+	struct log_rec rec;
+	unsigned long lag;
+
+	while (log_tail != log_head) {
+		rmb();
+		rec = log_ring[log_tail & (LOG_RING_SIZE - 1)];
+		log_tail++;
+
+		lag = ost_ticks_to_us(ost_stamp() - rec.ts);
+		if (lag > log_max_lag)
+			log_max_lag = lag;
+		printk(rec.fmt, rec.args[0], rec.args[1], rec.args[2], rec.args[3], rec.args[4],
+			rec.args[5], rec.args[6], rec.args[7], rec.args[8], rec.args[9]);
+	}
+}
+
+static int log_thread(void *data)
+{
+	daemonize();
+	strcpy(current->comm, "psjbipaqlogd");
+
+	while (!log_thread_stop) {
+		log_ring_drain();
+		interruptible_sleep_on_timeout(&log_wait, HZ / 50);
+	}
+	log_ring_drain();
+
+	complete_and_exit(&log_thread_exited, 0);
+	return 0;
+}
+
+static int log_ring_init(void)
+{
+	log_head = log_tail = 0;
+	log_dropped = 0;
+	log_max_lag = 0;
+	log_thread_stop = 0;
+
+	log_thread_pid = kernel_thread(log_thread, NULL, CLONE_FS | CLONE_FILES | CLONE_SIGHAND);
+	if (log_thread_pid < 0) {
+		printk("log_ring: couldn't start log thread rc=%d, logging synchronously\n", log_thread_pid);
+		log_async = 0;
+	}
+	return 0;
+}
+
+static void log_ring_exit(void)
+{
+	if (log_thread_pid >= 0) {
+		log_thread_stop = 1;
+		wake_up_interruptible(&log_wait);
+		wait_for_completion(&log_thread_exited);
+		log_thread_pid = -1;
+	}
+	log_async = 0;
+	log_ring_drain();
+
+	if (log_dropped || log_max_lag)
+		printk("log_ring: %lu records dropped, max lag %lu us\n", log_dropped, log_max_lag);
+}
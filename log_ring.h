@@ -0,0 +1,46 @@
+/*
+ * log_ring.h -- deferred logging for the UDC interrupt path
+ *
+ * This software is distributed under the terms of the GNU General Public
+ * License ("GPL") version 3, as published by the Free Software Foundation.
+ *
+ * A printk on the iPAQ serial console costs milliseconds per line, which
+ * is enough to change the timing of the whole exploit sequence. With
+ * log_async set, PRINTKI/PRINTKD only drop a binary record (timestamp,
+ * format, raw arguments) in a fixed size ring and a kernel thread formats
+ * them later. Formats must only use 32 bit arguments (ints, pointers,
+ * string constants) and at most LOG_MAX_ARGS of them.
+ */
+
+#ifndef _LOG_RING_H
+#define _LOG_RING_H
+
+#define LOG_RING_SIZE	256		/* records, power of two */
+#define LOG_MAX_ARGS	10
+
+struct log_rec {
+	ost_stamp_t ts;			/* when logged */
+	const char *fmt;
+	unsigned long args[LOG_MAX_ARGS];
+};
+
+/* number of arguments after the format, 0..LOG_MAX_ARGS */
+#define LOG_NARGS(args...) \
+	LOG_NARGS_(0 , ## args, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(z, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, n, rest...) n
+
+#define LOG_RING(fmt, args...) \
+	do { \
+		if (log_async) \
+			log_ring_put(fmt, LOG_NARGS(args) , ## args); \
+		else \
+			printk(fmt , ## args); \
+	} while (0)
+
+static int log_async = 1;
+
+static void log_ring_put(const char *fmt, int nargs, ...);
+static int  log_ring_init(void);
+static void log_ring_exit(void);
+
+#endif /* _LOG_RING_H */
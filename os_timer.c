@@ -0,0 +1,197 @@
+/*
+ * os_timer.c -- short one-shot callbacks on the SA-1100 OS timer
+ *
+ * This software is distributed under the terms of the GNU General Public
+ * License ("GPL") version 3, as published by the Free Software Foundation.
+ *
+ * OSMR0 drives the kernel tick and OSMR3 is the watchdog, so we take OSMR1
+ * and its interrupt. Pending events are kept in a short list sorted by
+ * expiry; the match register always holds the head. Callbacks run in
+ * interrupt context with interrupts off, like the UDC handler.
+ *
+ * If IRQ_OST1 can't be had we fall back to a kernel timer, which works
+ * but rounds everything up to the next jiffy.
+ */
+
+#include <linux/sched.h>
+#include <asm/irq.h>
+#include "os_timer.h"
+
+#define OST_STAMP_KEEP	(60 * HZ)	/* well inside one OSCR wrap */
+
+__u32 ost_stamp_hi;
+__u32 ost_stamp_last;
+
+static struct ost_event *ost_head;
+static int ost_irq_ok = 0;
+static struct timer_list ost_fallback;
+static struct timer_list ost_stamp_keeper;
+
+static void ost_program(void)
+{
+	if (!ost_head) {
+		if (ost_irq_ok)
+			OIER &= ~OIER_E1;
+		else
+			del_timer(&ost_fallback);
+		return;
+	}
+
+	if (!ost_irq_ok) {
+		__u32 ticks = ost_head->expires - OSCR;
+		if ((int) ticks < 0)
+			ticks = 0;
+		mod_timer(&ost_fallback, jiffies + 1 + ticks / (OST_TICK_RATE / HZ));
+		return;
+	}
+
+	/* a match in the past would only fire after OSCR wraps */
+	if ((int) (ost_head->expires - OSCR) < OST_MIN_TICKS)
+		OSMR1 = OSCR + OST_MIN_TICKS;
+	else
+		OSMR1 = ost_head->expires;
+	OSSR = OSSR_M1;
+	OIER |= OIER_E1;
+}
+
+static void ost_run(void)
+{
+	struct ost_event *ev;
+
+	while ((ev = ost_head) && (int) (OSCR - ev->expires) >= 0) {
+		ost_head = ev->next;
+		ev->next = NULL;
+		ev->pending = 0;
+		ev->function(ev->data);
+	}
+	ost_program();
+}
+
+static void ost_int_hndlr(int irq, void *dev_id, struct pt_regs *regs)
+{
+	OSSR = OSSR_M1;
+	ost_run();
+}
+
+static void ost_fallback_timeout(unsigned long data)
+{
+	int flags;
+
+	local_irq_save(flags);
+	ost_run();
+	local_irq_restore(flags);
+}
+
+static void ost_stamp_keep(unsigned long data)
+{
+	ost_stamp();
+	mod_timer(&ost_stamp_keeper, jiffies + OST_STAMP_KEEP);
+}
+
+static void ost_unlink(struct ost_event *ev)
+{
+	struct ost_event **pp;
+
+	for (pp = &ost_head; *pp; pp = &(*pp)->next) {
+		if (*pp == ev) {
+			*pp = ev->next;
+			break;
+		}
+	}
+	ev->next = NULL;
+	ev->pending = 0;
+}
+
+/* (Re)arm ev to fire us microseconds from now */
+void ost_add(struct ost_event *ev, unsigned int us)
+{
+	struct ost_event **pp;
+	int flags;
+
+	local_irq_save(flags);
+	if (ev->pending)
+		ost_unlink(ev);
+
+	ev->expires = OSCR + ost_us_to_ticks(us);
+	for (pp = &ost_head; *pp; pp = &(*pp)->next) {
+		if ((int) (ev->expires - (*pp)->expires) < 0)
+			break;
+	}
+	ev->next = *pp;
+	*pp = ev;
+	ev->pending = 1;
+
+	if (ost_head == ev)
+		ost_program();
+	local_irq_restore(flags);
+}
+
+void ost_del(struct ost_event *ev)
+{
+	int flags;
+
+	local_irq_save(flags);
+	if (ev->pending) {
+		int was_head = (ost_head == ev);
+		ost_unlink(ev);
+		if (was_head)
+			ost_program();
+	}
+	local_irq_restore(flags);
+}
+
+/* hold off event callbacks, e.g. while a bottom half touches their state */
+void ost_block(void)
+{
+	if (ost_irq_ok)
+		disable_irq(IRQ_OST1);
+}
+
+void ost_unblock(void)
+{
+	if (ost_irq_ok)
+		enable_irq(IRQ_OST1);
+}
+
+int ost_init(void)
+{
+	int retval;
+
+	ost_head = NULL;
+	init_timer(&ost_fallback);
+	ost_fallback.function = ost_fallback_timeout;
+
+	ost_stamp_hi = 0;
+	ost_stamp_last = OSCR;
+	init_timer(&ost_stamp_keeper);
+	ost_stamp_keeper.function = ost_stamp_keep;
+	mod_timer(&ost_stamp_keeper, jiffies + OST_STAMP_KEEP);
+
+	OIER &= ~OIER_E1;
+	OSSR = OSSR_M1;
+	retval = request_irq(IRQ_OST1, ost_int_hndlr, SA_INTERRUPT, "PSJBiPAQ timer", NULL);
+	if (retval) {
+		printk("os_timer: couldn't get IRQ_OST1 rc=%d, using jiffies\n", retval);
+		ost_irq_ok = 0;
+	} else {
+		ost_irq_ok = 1;
+	}
+	return 0;
+}
+
+void ost_exit(void)
+{
+	int flags;
+
+	local_irq_save(flags);
+	ost_head = NULL;
+	if (ost_irq_ok)
+		OIER &= ~OIER_E1;
+	local_irq_restore(flags);
+
+	del_timer(&ost_fallback);
+	del_timer(&ost_stamp_keeper);
+	if (ost_irq_ok)
+		free_irq(IRQ_OST1, NULL);
+	ost_irq_ok = 0;
+}
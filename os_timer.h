@@ -0,0 +1,89 @@
+/*
+ * os_timer.h -- short one-shot callbacks on the SA-1100 OS timer
+ *
+ * This software is distributed under the terms of the GNU General Public
+ * License ("GPL") version 3, as published by the Free Software Foundation.
+ *
+ * The kernel timer only resolves 10 ms at HZ=100, which is far too coarse
+ * for retrying a UDC register write. These events run off the free running
+ * OSCR counter (3.6864 MHz) and a spare match register instead.
+ */
+
+#ifndef _OS_TIMER_H
+#define _OS_TIMER_H
+
+#include <linux/timer.h>
+#include <asm/hardware.h>
+#include <asm/div64.h>
+
+#define OST_TICK_RATE	3686400		/* OSCR frequency, Hz */
+#define OST_MIN_TICKS	8		/* never program a match closer than this */
+#define OST_MAX_US	1000000		/* ost_us_to_ticks() is exact up to here */
+
+struct ost_event {
+	void (*function)(unsigned long);
+	unsigned long data;
+	__u32 expires;			/* OSCR value */
+	int pending;
+	struct ost_event *next;
+};
+
+/*
+ * 64 bit timestamps: OSCR with the wraps counted in software. OSCR wraps
+ * every ~19.4 minutes, so ost_stamp() has to be called at least that
+ * often; os_timer.c keeps a slow kernel timer around to guarantee it.
+ */
+typedef unsigned long long ost_stamp_t;
+
+extern __u32 ost_stamp_hi;
+extern __u32 ost_stamp_last;
+
+static inline ost_stamp_t ost_stamp(void)
+{
+	ost_stamp_t t;
+	__u32 now;
+	int flags;
+
+	local_irq_save(flags);
+	now = OSCR;
+	if (now < ost_stamp_last)
+		ost_stamp_hi++;
+	ost_stamp_last = now;
+	t = ((ost_stamp_t) ost_stamp_hi << 32) | now;
+	local_irq_restore(flags);
+	return t;
+}
+
+/* OSCR ticks -> us, 1 tick = 625/2304 us */
+static inline unsigned long ost_ticks_to_us(ost_stamp_t ticks)
+{
+	ticks *= 625;
+	do_div(ticks, 2304);
+	return (unsigned long) ticks;
+}
+
+/* us -> OSCR ticks, 3.6864 ticks per us without 64 bit arithmetic */
+static inline __u32 ost_us_to_ticks(unsigned int us)
+{
+	if (us > OST_MAX_US)
+		us = OST_MAX_US;
+	return us * 3 + (us * 4290) / 6250;
+}
+
+static inline void ost_init_event(struct ost_event *ev, void (*function)(unsigned long),
+	unsigned long data)
+{
+	ev->function = function;
+	ev->data = data;
+	ev->pending = 0;
+	ev->next = NULL;
+}
+
+int  ost_init(void);
+void ost_exit(void);
+void ost_block(void);
+void ost_unblock(void);
+void ost_add(struct ost_event *ev, unsigned int us);
+void ost_del(struct ost_event *ev);
+
+#endif /* _OS_TIMER_H */
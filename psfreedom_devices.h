@@ -25,7 +25,7 @@
 static int jig_set_config(void);
 static void jig_interrupt_complete(int flag, int size);
 static void jig_response_send (void);
-static void jig_response_complete(int flag, int size);
+static void jig_response_complete(struct usb_request *req);
 
 /* Default firmware is the first entry in the list */
 // static const Firmware_t supported_firmwares[] = {
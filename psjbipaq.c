@@ -21,6 +21,10 @@
 #include <linux/module.h>  
 #include <linux/kernel.h>
 #include "usb_ctl.h"
+#include "os_timer.c"
+#include "log_ring.c"
+#include "udc_reg.c"
+#include "udc_fiq.c"
 #include "hub.c"
 #include "usb_ctl.c"
 #include "usb_send.c"
@@ -46,7 +50,7 @@ static void state_machine_timeout(unsigned long data)
 		return;
 	}	
 	
-	PRINTKI( "[%lu]Timer fired, status is %s.\n", (jiffies-start_time)*10, STATUS_STR (machine_state ));
+	PRINTKI( "[%lu]Timer fired, status is %s.\n", NOW_US(), STATUS_STR (machine_state ));
 	
 	local_irq_save(flags);
 	
@@ -109,8 +113,8 @@ static void state_machine_timeout(unsigned long data)
 		break;
 	case DEVICE1_DISCONNECTED:
 		machine_state = DONE;
-		printk("[%lu]It worked!!.\n", (jiffies-start_time)*10);
-		del_timer (&state_machine_timer);
+		printk("[%lu]It worked!!.\n", NOW_US());
+		ost_del (&state_machine_event);
 		timer_added = 0;
 		break;
 	default:
@@ -119,25 +123,51 @@ static void state_machine_timeout(unsigned long data)
 	local_irq_restore(flags);
 }
 
+/*
+ * state_machine_fire()
+ * OS timer callback for state_machine_event. Accounts how late the step
+ * ran against the match it was scheduled for.
+ */
+static void state_machine_fire(unsigned long data)
+{
+	__u32 late = OSCR - state_machine_event.expires;
+
+	/* the UDC is down for a kick, core_kick_done() runs this step */
+	if (core_kick_event.pending) {
+		core_kick_sm_held = 1;
+		usbd_info.stats.kick_held++;
+		return;
+	}
+
+	usbd_info.stats.sm_steps++;
+	usbd_info.stats.sm_late_ticks += late;
+	if (late > usbd_info.stats.sm_late_max_ticks)
+		usbd_info.stats.sm_late_max_ticks = late;
+	state_machine_timeout(data);
+}
+
 int init_module(void)
 {
 	int result;
 
 	start_time = 0;
+	log_ring_init();
 	result = usbctl_init();
 	
 	if (result)	{
 		usbctl_exit();
+		log_ring_exit();
 		return result;
 	}
 	
 	machine_state = INIT;
-	state_machine_timer.function = state_machine_timeout;
+	ost_init_event(&state_machine_event, state_machine_fire, 0);
 	
 	result = sa1100_usb_start();
 	
 	if (result)	{
 		usbctl_exit();
+		log_ring_exit();
 		return result;
 	}	
 
@@ -150,7 +180,9 @@ void cleanup_module(void)
 	ipaq_led_off (GREEN_LED);
 
 	sa1100_usb_stop();
+	usbctl_print_stats();
 	usbctl_exit();
+	log_ring_exit();
 	printk("------------- PSJBiPAQ Closed ------------\n");
 }  
 
@@ -165,4 +197,42 @@ MODULE_PARM_DESC(port_delay, "port delay");
 MODULE_PARM(eventa, "i");
 MODULE_PARM_DESC(eventa, "event activate info");
 MODULE_PARM(eventd, "i");
-MODULE_PARM_DESC(eventd, "event deactivate info");
\ No newline at end of file
+MODULE_PARM_DESC(eventd, "event deactivate info");
+MODULE_PARM(sm_hop_us, "i");
+MODULE_PARM_DESC(sm_hop_us, "Delay of the short state machine hops in us (10000 = old 10 ms)");
+MODULE_PARM(ep0_burst, "i");
+MODULE_PARM_DESC(ep0_burst, "Write ep0 FIFO packets in one burst (0 = bytewise)");
+MODULE_PARM(ep0_cs_async, "i");
+MODULE_PARM_DESC(ep0_cs_async, "Confirm ep0 DE/IPR writes later instead of spinning (0 = spin)");
+MODULE_PARM(ep0_zlp_mode, "i");
+MODULE_PARM_DESC(ep0_zlp_mode, "Short transfer retirement: 0 = delay every packet, 1 = poll last packet, 2 = status interrupt");
+MODULE_PARM(ep0_zlp_bench, "i");
+MODULE_PARM_DESC(ep0_zlp_bench, "Time every short ep0 transfer");
+MODULE_PARM(ep2_pio, "i");
+MODULE_PARM_DESC(ep2_pio, "Ports (bit mask, bit 0 = hub) sending packets of 8 bytes or less by PIO");
+MODULE_PARM(ep2_dma_mode, "i");
+MODULE_PARM_DESC(ep2_dma_mode, "EP2 DMA: 0 = start per packet, 1 = spin until done (old workaround), 2 = A/B ping-pong");
+MODULE_PARM(ep2_retry_pkt, "i");
+MODULE_PARM_DESC(ep2_retry_pkt, "Times a failed EP2 packet is sent again before the transfer fails");
+MODULE_PARM(ep2_retry_xfer, "i");
+MODULE_PARM_DESC(ep2_retry_xfer, "EP2 retries allowed over one whole transfer");
+MODULE_PARM(udc_prio, "i");
+MODULE_PARM_DESC(udc_prio, "UDC endpoint order: 0 = ep1, ep2, ep0, 1 = ep2 first while a hub notification is pending, 2 = ep2 always first");
+MODULE_PARM(udc_loop_max, "i");
+MODULE_PARM_DESC(udc_loop_max, "Ser0UDCSR passes per UDC interrupt");
+MODULE_PARM(core_kick_async, "i");
+MODULE_PARM_DESC(core_kick_async, "Wait out the UDC kick on resume with a timer event (0 = udelay with interrupts off)");
+MODULE_PARM(core_kick_us, "i");
+MODULE_PARM_DESC(core_kick_us, "How long the UDC is held disabled on resume, us");
+MODULE_PARM(udc_fiq, "i");
+MODULE_PARM_DESC(udc_fiq, "Take SETUP packets from the ep0 FIFO in a FIQ handler (0 = plain IRQ)");
+MODULE_PARM(udc_bh, "i");
+MODULE_PARM_DESC(udc_bh, "Run request completions and hub side effects from a tasklet (0 = in the interrupt)");
+MODULE_PARM(udc_policy, "1-9i");
+MODULE_PARM_DESC(udc_policy, "UDC register write policy for CR,AR,OMP,IMP,CS0,CS1,CS2,SR,other: 0 = verify, 1 = once, 2 = verify with backoff");
+MODULE_PARM(udc_spin_max, "i");
+MODULE_PARM_DESC(udc_spin_max, "Tries before a verified UDC register write gives up");
+MODULE_PARM(udc_backoff_max, "i");
+MODULE_PARM_DESC(udc_backoff_max, "Tries before a backoff UDC register write gives up");
+MODULE_PARM(log_async, "i");
+MODULE_PARM_DESC(log_async, "Defer info/debug output to a log thread (0 = printk at once)");
\ No newline at end of file
@@ -0,0 +1,239 @@
+/*
+ * udc_fiq.c -- optional FIQ handling of the UDC interrupt
+ *
+ * This software is distributed under the terms of the GNU General Public
+ * License ("GPL") version 3, as published by the Free Software Foundation.
+ *
+ * See udc_fiq.h. The FIQ handler is copied to the FIQ vector by
+ * set_fiq_handler() and runs on the banked FIQ registers, which
+ * set_fiq_regs() loads once:
+ *  r8   &udc_fiq_ring
+ *  r9   &Ser0UDCCR (UDC registers)
+ *  r10  &ICLR
+ *  r11  &OSMR0 (OS timer registers)
+ * r12 and r13 are scratch. It has no stack and calls nothing.
+ */
+
+#include <asm/fiq.h>
+#include "udc_fiq.h"
+
+#define UDC_FIQ_STR_(x)	#x
+#define UDC_FIQ_STR(x)	UDC_FIQ_STR_(x)
+
+static struct udc_fiq_ring udc_fiq_ring;
+static __u32 udc_fiq_tail;		/* next slot to drain */
+
+/* SETUP packets drained from the ring, waiting for sh_setup_begin() */
+static struct {
+	__u8 setup[8];
+	__u32 stamp;
+} udc_fiq_setups[UDC_FIQ_RING];
+static unsigned int udc_fiq_setup_head;
+static unsigned int udc_fiq_setup_tail;
+
+static struct fiq_handler udc_fh = {
+	name: "psjbipaq UDC",
+};
+
+extern unsigned char udc_fiq_start, udc_fiq_end;
+
+#define UDC_FIQ_COPY(n) \
+"	ldr	r12, [r9, #" UDC_FIQ_STR(UDC_FIQ_D0) "]\n" \
+"	strb	r12, [r13, #8 + " #n "]\n"
+
+__asm__(
+"	.text\n"
+"	.align	2\n"
+"udc_fiq_start:\n"
+"	ldr	r12, [r8]			@ head\n"
+"	and	r13, r12, #15			@ UDC_FIQ_RING - 1\n"
+"	add	r13, r8, r13, lsl #4\n"
+"	add	r13, r13, #16			@ r13 = &slot[head & 15]\n"
+"	add	r12, r12, #1\n"
+"	str	r12, [r8]\n"
+"	ldr	r12, [r11, #" UDC_FIQ_STR(UDC_FIQ_OSCR) "]\n"
+"	str	r12, [r13]			@ slot->stamp\n"
+"	mov	r12, #" UDC_FIQ_STR(UDC_FIQ_HANDOFF) "\n"
+"	str	r12, [r13, #4]			@ slot->kind\n"
+"	ldr	r12, [r9, #" UDC_FIQ_STR(UDC_FIQ_SR) "]\n"
+"	tst	r12, #" UDC_FIQ_STR(UDCSR_EIR) "\n"
+"	beq	1f\n"
+"	ldr	r12, [r9, #" UDC_FIQ_STR(UDC_FIQ_CS0) "]\n"
+"	tst	r12, #" UDC_FIQ_STR(UDCCS0_OPR) "\n"
+"	beq	1f\n"
+"	ldr	r12, [r9, #" UDC_FIQ_STR(UDC_FIQ_WC) "]\n"
+"	and	r12, r12, #0xff\n"
+"	teq	r12, #8\n"
+"	bne	1f\n"
+UDC_FIQ_COPY(0) UDC_FIQ_COPY(1) UDC_FIQ_COPY(2) UDC_FIQ_COPY(3)
+UDC_FIQ_COPY(4) UDC_FIQ_COPY(5) UDC_FIQ_COPY(6) UDC_FIQ_COPY(7)
+"	ldr	r12, [r9, #" UDC_FIQ_STR(UDC_FIQ_WC) "]\n"
+"	ands	r12, r12, #0xff\n"
+"	bne	1f				@ a read didn't pop: let ep0 stall it\n"
+"	mov	r12, #" UDC_FIQ_STR(UDC_FIQ_SETUP) "\n"
+"	str	r12, [r13, #4]\n"
+"	mov	r12, #" UDC_FIQ_STR(UDCSR_EIR) "\n"
+"	str	r12, [r9, #" UDC_FIQ_STR(UDC_FIQ_SR) "]	@ acknowledge EIR\n"
+"	ldr	r12, [r11, #" UDC_FIQ_STR(UDC_FIQ_OSCR) "]\n"
+"	add	r12, r12, #" UDC_FIQ_STR(UDC_FIQ_BELL) "\n"
+"	str	r12, [r11, #" UDC_FIQ_STR(UDC_FIQ_OSMR2) "]	@ doorbell\n"
+"	subs	pc, lr, #4\n"
+"1:	ldr	r12, [r10]\n"
+"	bic	r12, r12, #" UDC_FIQ_STR(UDC_FIQ_BIT) "\n"
+"	str	r12, [r10]			@ back to IRQ, the source stays pending there\n"
+"	subs	pc, lr, #4\n"
+"udc_fiq_end:\n"
+);
+
+/* OSMR2 match: a SETUP was taken by the FIQ handler */
+static void udc_fiq_doorbell(int irq, void *dev_id, struct pt_regs *regs)
+{
+	OSSR = OSSR_M2;
+	/* OSCR passes OSMR2 once per wrap on its own, too */
+	if (udc_fiq_ring.head == udc_fiq_tail && !udc_fiq_status())
+		return;
+	usbd_info.stats.fiq_doorbells++;
+	udc_int_hndlr(irq, dev_id, regs);
+}
+
+static int udc_fiq_init(void)
+{
+	struct pt_regs regs;
+	unsigned long udc = (unsigned long) &Ser0UDCCR;
+	unsigned long ost = (unsigned long) &OSMR0;
+	int flags;
+	int retval;
+
+	if ((unsigned long) &Ser0UDCCS0 - udc != UDC_FIQ_CS0 ||
+	    (unsigned long) &Ser0UDCD0 - udc != UDC_FIQ_D0 ||
+	    (unsigned long) &Ser0UDCWC - udc != UDC_FIQ_WC ||
+	    (unsigned long) &Ser0UDCSR - udc != UDC_FIQ_SR ||
+	    (unsigned long) &OSMR2 - ost != UDC_FIQ_OSMR2 ||
+	    (unsigned long) &OSCR - ost != UDC_FIQ_OSCR)
+		return -EINVAL;
+
+	retval = request_irq(IRQ_OST2, udc_fiq_doorbell, SA_INTERRUPT, "PSJBiPAQ doorbell", NULL);
+	if (retval)
+		return retval;
+
+	retval = claim_fiq(&udc_fh);
+	if (retval) {
+		free_irq(IRQ_OST2, NULL);
+		return retval;
+	}
+
+	memset((void *) &udc_fiq_ring, 0, sizeof(udc_fiq_ring));
+	udc_fiq_tail = 0;
+	udc_fiq_setup_flush();
+	set_fiq_handler(&udc_fiq_start, &udc_fiq_end - &udc_fiq_start);
+
+	memset(&regs, 0, sizeof(regs));
+	regs.ARM_r8 = (long) &udc_fiq_ring;
+	regs.ARM_r9 = (long) udc;
+	regs.ARM_r10 = (long) &ICLR;
+	regs.ARM_r11 = (long) ost;
+	set_fiq_regs(&regs);
+
+	/* E2 stays on: the FIQ handler only writes OSMR2 */
+	local_irq_save(flags);
+	OSMR2 = OSCR - 1;
+	OSSR = OSSR_M2;
+	OIER |= OIER_E2;
+	udc_fiq_on = 1;
+	ICLR |= UDC_FIQ_BIT;
+	local_irq_restore(flags);
+	return 0;
+}
+
+static void udc_fiq_exit(void)
+{
+	int flags;
+
+	if (!udc_fiq_on)
+		return;
+
+	local_irq_save(flags);
+	ICLR &= ~UDC_FIQ_BIT;
+	OIER &= ~OIER_E2;
+	OSSR = OSSR_M2;
+	udc_fiq_on = 0;
+	local_irq_restore(flags);
+	release_fiq(&udc_fh);
+	free_irq(IRQ_OST2, NULL);
+}
+
+/* start of udc_int_hndlr(): account and sort what the FIQ handler left */
+static void udc_fiq_irq(__u32 now)
+{
+	volatile struct udc_fiq_slot *s;
+	__u32 head = udc_fiq_ring.head;
+	__u32 dt;
+	int i;
+
+	if (head - udc_fiq_tail > UDC_FIQ_RING) {
+		usbd_info.stats.fiq_overruns += head - udc_fiq_tail - UDC_FIQ_RING;
+		udc_fiq_tail = head - UDC_FIQ_RING;
+	}
+	while (udc_fiq_tail != head) {
+		s = &udc_fiq_ring.slot[udc_fiq_tail & (UDC_FIQ_RING - 1)];
+		udc_fiq_tail++;
+		dt = now - s->stamp;
+		usbd_info.stats.fiq_events++;
+		usbd_info.stats.fiq_wait_ticks += dt;
+		if (dt > usbd_info.stats.fiq_wait_max_ticks)
+			usbd_info.stats.fiq_wait_max_ticks = dt;
+
+		if (s->kind != UDC_FIQ_SETUP)
+			continue;
+		usbd_info.stats.fiq_setups++;
+		if (udc_fiq_setup_head - udc_fiq_setup_tail >= UDC_FIQ_RING) {
+			usbd_info.stats.fiq_overruns++;
+			continue;
+		}
+		i = udc_fiq_setup_head++ & (UDC_FIQ_RING - 1);
+		memcpy(udc_fiq_setups[i].setup, (void *) s->setup, 8);
+		udc_fiq_setups[i].stamp = s->stamp;
+	}
+}
+
+/* EIR the FIQ handler acknowledged for a SETUP that ep0 hasn't seen yet */
+static __u32 udc_fiq_status(void)
+{
+	return udc_fiq_setup_head != udc_fiq_setup_tail ? UDCSR_EIR : 0;
+}
+
+/*
+ * udc_fiq_take_setup()
+ * For sh_setup_begin(): the oldest SETUP taken by the FIQ handler, with
+ * when it came in. 0 if there is none and the FIFO has to be read.
+ */
+static int udc_fiq_take_setup(void *req, __u32 *stamp)
+{
+	int i;
+
+	if (udc_fiq_setup_head == udc_fiq_setup_tail)
+		return 0;
+	i = udc_fiq_setup_tail++ & (UDC_FIQ_RING - 1);
+	memcpy(req, udc_fiq_setups[i].setup, 8);
+	*stamp = udc_fiq_setups[i].stamp;
+	return 8;
+}
+
+/* ep0 reset: SETUPs from before it are stale */
+static void udc_fiq_setup_flush(void)
+{
+	udc_fiq_setup_head = udc_fiq_setup_tail = 0;
+}
+
+/* hold off the doorbell along with the UDC irq */
+static void udc_fiq_block(void)
+{
+	if (udc_fiq_on)
+		disable_irq(IRQ_OST2);
+}
+
+static void udc_fiq_unblock(void)
+{
+	if (udc_fiq_on)
+		enable_irq(IRQ_OST2);
+}
@@ -0,0 +1,71 @@
+/*
+ * udc_fiq.h -- optional FIQ handling of the UDC interrupt
+ *
+ * This software is distributed under the terms of the GNU General Public
+ * License ("GPL") version 3, as published by the Free Software Foundation.
+ *
+ * With udc_fiq set, the UDC source is routed to FIQ (ICLR). FIQs are not
+ * held off by local_irq_save() or by other interrupt handlers, so a SETUP
+ * packet is taken out of the ep0 FIFO within a few instructions whatever
+ * the rest of the kernel is doing. For every entry the FIQ handler fills
+ * one slot of a ring shared with the IRQ level code:
+ *  - EIR with OPR and 8 bytes in the FIFO: copy them into the slot,
+ *    acknowledge EIR and ring the doorbell (OSMR2 a few ticks ahead), whose
+ *    IRQ runs udc_int_hndlr(); ep0 takes the SETUP from the ring instead
+ *    of reading the FIFO
+ *  - anything else: stamp the slot and route the source back to IRQ,
+ *    where the still pending event runs udc_int_hndlr() as usual
+ * udc_int_hndlr() drains the ring and routes the next event to FIQ again.
+ */
+
+#ifndef _UDC_FIQ_H
+#define _UDC_FIQ_H
+
+#define UDC_FIQ_RING	16		/* slots, power of two; the handler masks with 15 */
+#define UDC_FIQ_BIT	(1 << IRQ_Ser0UDC)
+
+/* register offsets the handler uses, from Ser0UDCCR and OSMR0; checked at init */
+#define UDC_FIQ_CS0	0x10
+#define UDC_FIQ_D0	0x1c
+#define UDC_FIQ_WC	0x20
+#define UDC_FIQ_SR	0x30
+#define UDC_FIQ_OSMR2	0x08
+#define UDC_FIQ_OSCR	0x10
+#define UDC_FIQ_BELL	4		/* OSCR ticks to the doorbell */
+
+/* slot kinds; defines, the handler uses them as immediates */
+#define UDC_FIQ_HANDOFF	0		/* routed back to IRQ */
+#define UDC_FIQ_SETUP	1		/* SETUP read, EIR acknowledged */
+
+struct udc_fiq_slot {
+	__u32 stamp;			/* OSCR at FIQ entry */
+	__u32 kind;			/* UDC_FIQ_* */
+	__u8 setup[8];			/* the SETUP packet, UDC_FIQ_SETUP only */
+};
+
+struct udc_fiq_ring {
+	volatile __u32 head;		/* bumped by the FIQ handler only */
+	__u32 pad[3];
+	volatile struct udc_fiq_slot slot[UDC_FIQ_RING];	/* at +16 */
+};
+
+static int udc_fiq = 0;
+static int udc_fiq_on;			/* routing is in place */
+
+static int  udc_fiq_init(void);
+static void udc_fiq_exit(void);
+static void udc_fiq_irq(__u32 now);
+static __u32 udc_fiq_status(void);
+static int  udc_fiq_take_setup(void *req, __u32 *stamp);
+static void udc_fiq_setup_flush(void);
+static void udc_fiq_block(void);
+static void udc_fiq_unblock(void);
+
+/* end of udc_int_hndlr(): the next event goes to FIQ again */
+static inline void udc_fiq_rearm(void)
+{
+	if (udc_fiq_on)
+		ICLR |= UDC_FIQ_BIT;
+}
+
+#endif /* _UDC_FIQ_H */
@@ -0,0 +1,178 @@
+/*
+ * udc_reg.c -- checked writes to the SA-1100 UDC registers
+ *
+ * This software is distributed under the terms of the GNU General Public
+ * License ("GPL") version 3, as published by the Free Software Foundation.
+ *
+ * See udc_reg.h. Call sites link themselves into udc_sites the first time
+ * they run, so only the ones that were used show up in /proc.
+ */
+
+#include "udc_reg.h"
+
+static struct udc_site *udc_sites;
+
+static const char * const udc_reg_names[UDC_REGS] = {
+	"CR", "AR", "OMP", "IMP", "CS0", "CS1", "CS2", "SR", "other"
+};
+static const char * const udc_op_names[] = { "write", "set", "clear", "flip" };
+static const char * const udc_pol_names[UDC_POLICIES] = { "verify", "once", "backoff" };
+
+static int udc_reg_id(volatile unsigned long *reg)
+{
+	if (reg == &Ser0UDCCR)
+		return UDC_REG_CR;
+	if (reg == &Ser0UDCAR)
+		return UDC_REG_AR;
+	if (reg == &Ser0UDCOMP)
+		return UDC_REG_OMP;
+	if (reg == &Ser0UDCIMP)
+		return UDC_REG_IMP;
+	if (reg == &Ser0UDCCS0)
+		return UDC_REG_CS0;
+	if (reg == &Ser0UDCCS1)
+		return UDC_REG_CS1;
+	if (reg == &Ser0UDCCS2)
+		return UDC_REG_CS2;
+	if (reg == &Ser0UDCSR)
+		return UDC_REG_SR;
+	return UDC_REG_OTHER;
+}
+
+static void udc_site_add(struct udc_site *s, volatile unsigned long *reg)
+{
+	int flags;
+
+	local_irq_save(flags);
+	if (s->id < 0) {
+		s->id = udc_reg_id(reg);
+		s->next = udc_sites;
+		udc_sites = s;
+	}
+	local_irq_restore(flags);
+}
+
+/* true once the register shows what the op was meant to do */
+static inline int udc_stuck(int op, volatile unsigned long *reg, unsigned long val)
+{
+	switch (op) {
+	case UDC_OP_WRITE:
+		return *reg == val;
+	case UDC_OP_SET:
+		return (*reg & val) != 0;
+	default:
+		return !(*reg & val);
+	}
+}
+
+static void udc_access(struct udc_site *s, volatile unsigned long *reg, unsigned long val)
+{
+	__u32 t0 = OSCR;
+	__u32 dt;
+	unsigned long tries = 0;
+	unsigned long limit;
+	int policy;
+
+	if (s->id < 0)
+		udc_site_add(s, reg);
+	s->calls++;
+
+	policy = udc_policy[s->id];
+	limit = policy == UDC_POL_BACKOFF ? udc_backoff_max : udc_spin_max;
+
+	/* the old UDC_flip wrote once more up front */
+	if (s->op == UDC_OP_FLIP && policy != UDC_POL_ONCE)
+		*reg = val;
+
+	for (;;) {
+		switch (s->op) {
+		case UDC_OP_SET:
+			*reg |= val;
+			break;
+		case UDC_OP_CLEAR:
+			*reg &= ~val;
+			break;
+		default:
+			*reg = val;
+			break;
+		}
+		tries++;
+		if (policy == UDC_POL_ONCE || udc_stuck(s->op, reg, val))
+			break;
+		if (tries > limit) {
+			s->failures++;
+			printk( "%s [%d]: %s %#lx %s %s (%#lx) failed\n", s->func, s->line,
+				udc_op_names[s->op], val, s->op == UDC_OP_WRITE ? "to" : "of",
+				s->reg, *reg);
+			break;
+		}
+		if (policy == UDC_POL_BACKOFF && tries >= UDC_BACKOFF_SPIN)
+			udelay(1);
+	}
+
+	if (tries > 1) {
+		dt = OSCR - t0;
+		s->retries += tries - 1;
+		if (tries > s->max_tries)
+			s->max_tries = tries;
+		if (dt > s->max_ticks)
+			s->max_ticks = dt;
+	}
+}
+
+/*
+ * udc_reg_read_proc()
+ * The policies, then one line per call site. Lines are handed out one at
+ * a time through *start, like the latency table.
+ */
+int udc_reg_read_proc(char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+	struct udc_site *s;
+	int row = off;
+	int rows = 0;
+	int len = 0;
+	int i;
+
+	for (;; row++, rows++) {
+		if (len + 160 > count)
+			break;
+		if (row == 0) {
+			len += sprintf(page + len, "policy:");
+			for (i = 0; i < UDC_REGS; i++)
+				len += sprintf(page + len, " %s=%s", udc_reg_names[i],
+					udc_policy[i] >= 0 && udc_policy[i] < UDC_POLICIES ?
+					udc_pol_names[udc_policy[i]] : "?");
+			len += sprintf(page + len, "\n%-28s %5s %-5s %-5s %8s %8s %6s %6s %7s\n",
+				"function", "line", "reg", "op", "calls", "retries", "failed",
+				"max", "max_us");
+			continue;
+		}
+		for (s = udc_sites, i = 1; s && i < row; s = s->next, i++)
+			;
+		if (!s) {
+			*eof = 1;
+			break;
+		}
+		len += sprintf(page + len, "%-28s %5d %-5s %-5s %8lu %8lu %6lu %6lu %7lu\n",
+			s->func, s->line, udc_reg_names[s->id], udc_op_names[s->op], s->calls,
+			s->retries, s->failures, s->max_tries, ost_ticks_to_us(s->max_ticks));
+	}
+
+	*start = (char *) (unsigned long) rows;
+	return len;
+}
+
+/* any write clears the counters */
+int udc_reg_write_proc(struct file *file, const char *buffer, unsigned long count, void *data)
+{
+	struct udc_site *s;
+	int flags;
+
+	local_irq_save(flags);
+	for (s = udc_sites; s; s = s->next) {
+		s->calls = s->retries = s->failures = s->max_tries = 0;
+		s->max_ticks = 0;
+	}
+	local_irq_restore(flags);
+	return count;
+}
@@ -0,0 +1,63 @@
+/*
+ * udc_reg.h -- checked writes to the SA-1100 UDC registers
+ *
+ * This software is distributed under the terms of the GNU General Public
+ * License ("GPL") version 3, as published by the Free Software Foundation.
+ *
+ * The UDC is known to drop register writes now and then, so every write
+ * used to be repeated until a read back showed it had stuck, up to 10000
+ * times. How hard to try is now chosen per register:
+ *  UDC_POL_VERIFY   re-write until it sticks, at most udc_spin_max tries
+ *  UDC_POL_ONCE     write once, no read back
+ *  UDC_POL_BACKOFF  as VERIFY, but after UDC_BACKOFF_SPIN tries wait a
+ *                   microsecond between tries, at most udc_backoff_max
+ * Every UDC_write/set/clear/flip call site counts its calls, extra tries
+ * and worst case in /proc/psjbipaq/udc_regs.
+ */
+
+#ifndef _UDC_REG_H
+#define _UDC_REG_H
+
+enum { UDC_POL_VERIFY=0, UDC_POL_ONCE=1, UDC_POL_BACKOFF=2, UDC_POLICIES=3 };
+
+/* registers with a policy of their own, anything else is UDC_REG_OTHER */
+enum { UDC_REG_CR=0, UDC_REG_AR=1, UDC_REG_OMP=2, UDC_REG_IMP=3, UDC_REG_CS0=4,
+	   UDC_REG_CS1=5, UDC_REG_CS2=6, UDC_REG_SR=7, UDC_REG_OTHER=8, UDC_REGS=9 };
+
+enum { UDC_OP_WRITE=0, UDC_OP_SET=1, UDC_OP_CLEAR=2, UDC_OP_FLIP=3 };
+
+#define UDC_BACKOFF_SPIN	16
+
+struct udc_site {
+	const char *func;
+	int line;
+	const char *reg;			/* as spelled at the call site */
+	int op;
+	int id;					/* UDC_REG_*, -1 until first use */
+	unsigned long calls;
+	unsigned long retries;			/* writes past the first */
+	unsigned long failures;			/* gave up */
+	unsigned long max_tries;
+	__u32 max_ticks;			/* OSCR, worst call that retried */
+	struct udc_site *next;
+};
+
+#define UDC_ACCESS(op, reg, val) { \
+	static struct udc_site __udc_site = { __FUNCTION__, __LINE__, #reg, op, -1 }; \
+	udc_access(&__udc_site, &(reg), (val)); \
+}
+
+#define UDC_write(reg, val)	UDC_ACCESS(UDC_OP_WRITE, reg, val)
+#define UDC_set(reg, val)	UDC_ACCESS(UDC_OP_SET, reg, val)
+#define UDC_clear(reg, val)	UDC_ACCESS(UDC_OP_CLEAR, reg, val)
+#define UDC_flip(reg, val)	UDC_ACCESS(UDC_OP_FLIP, reg, val)
+
+static int udc_policy[UDC_REGS];
+static int udc_spin_max = 10000;
+static int udc_backoff_max = 200;
+
+static void udc_access(struct udc_site *s, volatile unsigned long *reg, unsigned long val);
+int  udc_reg_read_proc(char *page, char **start, off_t off, int count, int *eof, void *data);
+int  udc_reg_write_proc(struct file *file, const char *buffer, unsigned long count, void *data);
+
+#endif /* _UDC_REG_H */
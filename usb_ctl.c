@@ -16,7 +16,9 @@
 #include <linux/init.h>
 #include <linux/tqueue.h>
 #include <linux/delay.h>
+#include <linux/bitops.h>
 #include <linux/slab.h>
+#include <linux/proc_fs.h>
 #include <asm/io.h>
 #include <asm/dma.h>
 #include <asm/irq.h>
@@ -34,27 +36,192 @@ static int rx_pktsize;
 static int timer_added = 0;
 static void * desc_buf;
 static int second_reset = 0;
+static struct proc_dir_entry *proc_dir;
 #define USB_BUFSIZ 4096
 
+/* core_kicker() state. While core_kick_event is pending the UDC is down
+   and the state machine, the bottom half and ep2 starts hold off */
+static int core_kick_async = 1;
+static int core_kick_us = 300;
+static struct ost_event core_kick_event;
+static __u32 core_kick_car, core_kick_imp, core_kick_omp, core_kick_mask;
+static __u32 core_kick_t0;
+static int core_kick_sm_held;		/* a state machine step waits for the kick */
+
 /* The port1 configuration descriptor. dynamically loaded from procfs */
 //u8 *port1_config_desc; // OJO
 unsigned int port1_config_desc_size = 3840; // OJO
 
 /* global write struct to keep write state around across interrupts */
 static struct {
-		unsigned char *p;
+		const unsigned char *p;
 		int bytes_left;
 } wr;
 
-static void udc_int_hndlr(int irq, void *dev_id, struct pt_regs *regs)
+//////////////////////////////////////////////////////////////////////////////
+// Bottom Half
+//////////////////////////////////////////////////////////////////////////////
+/*
+ * With udc_bh set the interrupt handler only does what the hardware
+ * needs right away: acknowledge Ser0UDCSR, move FIFO bytes, flip the
+ * endpoint control bits and start the next queued transfer. Request
+ * completions and the hub side effects they or ep0 trigger (port change
+ * notifications with their port_delay waits, state machine steps) run
+ * from a tasklet with interrupts on, in this order:
+ *  1. completions, in the order the endpoints finished them
+ *  2. a hub port change raised by ep0
+ *  3. a state machine step raised by ep0
+ * The UDC and OS timer interrupts are held off meanwhile, since both
+ * drive the same state; everything else gets through.
+ */
+static int udc_bh = 1;
+static struct usb_request *udc_bh_head;
+static struct usb_request *udc_bh_tail;
+static int udc_bh_events;			/* UDC_BH_* */
+
+static void udc_bh_run(unsigned long data);
+static DECLARE_TASKLET(udc_bh_tasklet, udc_bh_run, 0);
+
+/* hand a finished request to its owner */
+void udc_complete(struct usb_request *req)
 {
-	__u32 status = Ser0UDCSR;
-	
-	if (start_time==0) {
-		start_time = jiffies;
+	int flags;
+
+	if (!udc_bh) {
+		if (req->complete)
+			req->complete(req);
+		return;
 	}
-	
-	//PRINTKD("[%lu]Status %d Mask %d\n", (jiffies-start_time)*10, status, Ser0UDCCR);
+
+	local_irq_save(flags);
+	req->next = NULL;
+	if (udc_bh_tail)
+		udc_bh_tail->next = req;
+	else
+		udc_bh_head = req;
+	udc_bh_tail = req;
+	usbd_info.stats.bh_deferred++;
+	local_irq_restore(flags);
+	tasklet_schedule(&udc_bh_tasklet);
+}
+
+/* run a hub side effect later, or now without udc_bh */
+void udc_defer(int event)
+{
+	int flags;
+
+	if (!udc_bh) {
+		if (event & UDC_BH_PORT_CHANGED)
+			hub_port_changed();
+		if (event & UDC_BH_STATE_MACHINE)
+			state_machine_timeout(0);
+		return;
+	}
+
+	local_irq_save(flags);
+	udc_bh_events |= event;
+	usbd_info.stats.bh_deferred++;
+	local_irq_restore(flags);
+	tasklet_schedule(&udc_bh_tasklet);
+}
+
+static void udc_bh_run(unsigned long data)
+{
+	struct usb_request *req;
+	int events;
+	int flags;
+	__u32 t0 = OSCR;
+	__u32 dt;
+
+	/* the UDC is down, core_kick_done() reschedules us */
+	if (core_kick_event.pending) {
+		usbd_info.stats.kick_held++;
+		return;
+	}
+
+	disable_irq(IRQ_Ser0UDC);
+	ost_block();
+	udc_fiq_block();
+
+	for (;;) {
+		local_irq_save(flags);
+		req = udc_bh_head;
+		if (req) {
+			udc_bh_head = req->next;
+			if (!udc_bh_head)
+				udc_bh_tail = NULL;
+			req->next = NULL;
+		}
+		local_irq_restore(flags);
+		if (!req)
+			break;
+		if (req->complete)
+			req->complete(req);
+	}
+
+	local_irq_save(flags);
+	events = udc_bh_events;
+	udc_bh_events = 0;
+	local_irq_restore(flags);
+	if (events & UDC_BH_PORT_CHANGED)
+		hub_port_changed();
+	if (events & UDC_BH_STATE_MACHINE)
+		state_machine_timeout(0);
+
+	udc_fiq_unblock();
+	ost_unblock();
+	enable_irq(IRQ_Ser0UDC);
+
+	dt = OSCR - t0;
+	usbd_info.stats.bh_runs++;
+	usbd_info.stats.bh_ticks += dt;
+	if (dt > usbd_info.stats.bh_max_ticks)
+		usbd_info.stats.bh_max_ticks = dt;
+}
+
+/*
+ * At unload, before the OS timer and the UDC irq go: let a scheduled run
+ * finish, and have anything completing after this run inline.
+ */
+static void udc_bh_exit(void)
+{
+	udc_bh = 0;
+	tasklet_kill(&udc_bh_tasklet);
+	udc_bh_head = udc_bh_tail = NULL;
+	udc_bh_events = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Interrupt Handler
+//////////////////////////////////////////////////////////////////////////////
+/*
+ * Endpoint service order within one pass:
+ *  UDC_PRIO_FIXED  ep1, ep2, ep0 (the old order)
+ *  UDC_PRIO_HUB    ep2 first while a hub notification is outstanding
+ *  UDC_PRIO_EP2    ep2 always first
+ * Events that come up while one pass runs are picked up by the next, up
+ * to udc_loop_max passes per interrupt.
+ */
+static int udc_prio = UDC_PRIO_HUB;
+static int udc_loop_max = 8;
+
+static __u32 suspend_t0;		/* OSCR at the last suspend, 0 = awake */
+
+/* time spent handling a suspend or resume, interrupts off */
+static void udc_event_account(unsigned long *ticks, unsigned long *max_ticks, __u32 t0)
+{
+	__u32 dt = OSCR - t0;
+
+	*ticks += dt;
+	if (dt > *max_ticks)
+		*max_ticks = dt;
+}
+
+#define UDCSR_ALL	(UDCSR_RSTIR | UDCSR_RESIR | UDCSR_EIR | UDCSR_RIR | UDCSR_TIR | UDCSR_SUSIR)
+
+static void udc_int_service(__u32 status)
+{
+	//PRINTKD("[%lu]Status %d Mask %d\n", NOW_US(), status, Ser0UDCCR);
 
 	UDC_flip(Ser0UDCSR, status); // clear all pending sources
 	
@@ -80,7 +247,7 @@ static void udc_int_hndlr(int irq, void *dev_id, struct pt_regs *regs)
 		}
 		second_reset = 1;
 		//UDC_flip(Ser0UDCSR, status); // clear all pending sources
-		PRINTKI("[%lu]Reset: Mask %d\n", (jiffies-start_time)*10, Ser0UDCCR);		
+		PRINTKI("[%lu]Reset: Mask %d\n", NOW_US(), Ser0UDCCR);		
 		return;
 	}
 	
@@ -89,12 +256,18 @@ static void udc_int_hndlr(int irq, void *dev_id, struct pt_regs *regs)
 	// /* RESume Interrupt Request ojo eliminar?*/
 	if ( status & UDCSR_RESIR )
 	{
-		core_kicker();
-		Ser0UDCCR = 0xFC;
-		Ser0UDCCR = UDCCR_TIM | UDCCR_RESIM;
+		__u32 t0 = OSCR;
+
+		usbd_info.stats.resumes++;
+		if (suspend_t0) {
+			usbd_info.stats.suspended_ticks += t0 - suspend_t0;
+			suspend_t0 = 0;
+		}
+		core_kicker(UDCCR_TIM | UDCCR_RESIM);
 		
 		//UDC_flip(Ser0UDCSR, status); // clear all pending sources
-		PRINTKD("[%lu]Resume: Mask %d\n", (jiffies-start_time)*10, Ser0UDCCR);
+		PRINTKD("[%lu]Resume: Mask %d\n", NOW_US(), Ser0UDCCR);
+		udc_event_account(&usbd_info.stats.resume_ticks, &usbd_info.stats.resume_max_ticks, t0);
 		
 		return;
 	}
@@ -102,6 +275,10 @@ static void udc_int_hndlr(int irq, void *dev_id, struct pt_regs *regs)
 	/* SUSpend Interrupt Request */
 	if ( status & UDCSR_SUSIR )
 	{
+		__u32 t0 = OSCR;
+
+		usbd_info.stats.suspends++;
+		suspend_t0 = t0 ? t0 : 1;
 		Ser0UDCCR = 0xFC;
 		// Does not seems to help either to be necessary
 		// if (tr==2) {
@@ -111,12 +288,20 @@ static void udc_int_hndlr(int irq, void *dev_id, struct pt_regs *regs)
 		UDC_write(Ser0UDCCR, UDCCR_TIM | UDCCR_SUSIM); 
 		//UDC_write(Ser0UDCCR, UDCCR_TIM | UDCCR_SUSIM | UDCCR_REM); // Errata 29
 		//UDC_flip(Ser0UDCSR, status); // clear all pending sources
-		PRINTKI("[%lu]Suspended: Mask %d\n", (jiffies-start_time)*10, Ser0UDCCR);
+		PRINTKI("[%lu]Suspended: Mask %d\n", NOW_US(), Ser0UDCCR);
+		udc_event_account(&usbd_info.stats.suspend_ticks, &usbd_info.stats.suspend_max_ticks, t0);
 		return;
 	}	
 	
 	//UDC_flip(Ser0UDCSR, status); // clear all pending sources
-		
+
+	if ((status & UDCSR_TIR) && (udc_prio == UDC_PRIO_EP2 ||
+	    (udc_prio == UDC_PRIO_HUB && hub_interrupt_queued))) {
+		usbd_info.stats.irq_ep2_first++;
+		ep2_int_hndlr();
+		status &= ~UDCSR_TIR;
+	}
+
 	if (status & UDCSR_RIR)
 		ep1_int_hndlr();
 
@@ -127,21 +312,105 @@ static void udc_int_hndlr(int irq, void *dev_id, struct pt_regs *regs)
 		ep0_int_hndlr();
 }
 
+/*
+ * SA_INTERRUPT: all of this runs with interrupts off, so time it.
+ * Ser0UDCSR is read again after every pass until nothing is left.
+ */
+static void udc_int_hndlr(int irq, void *dev_id, struct pt_regs *regs)
+{
+	__u32 t0 = OSCR;
+	__u32 dt;
+	__u32 status;
+	int pass;
+	
+	if (start_time==0) {
+		start_time = ost_stamp();
+	}
+
+	if (udc_fiq_on)
+		udc_fiq_irq(t0);
+
+	for (pass = 0; pass < udc_loop_max; pass++) {
+		status = Ser0UDCSR & UDCSR_ALL;
+		/* a SETUP the FIQ handler took, its EIR is already acknowledged */
+		if (pass == 0)
+			status |= udc_fiq_status();
+		if (!status)
+			break;
+		usbd_info.stats.irq_passes++;
+		usbd_info.stats.irq_events += hweight32(status);
+		udc_int_service(status);
+	}
+	if (pass == udc_loop_max && (Ser0UDCSR & UDCSR_ALL))
+		usbd_info.stats.irq_loop_limit++;
+
+	dt = OSCR - t0;
+	usbd_info.stats.irq_count++;
+	usbd_info.stats.irq_ticks += dt;
+	if (dt > usbd_info.stats.irq_max_ticks)
+		usbd_info.stats.irq_max_ticks = dt;
+
+	udc_fiq_rearm();
+}
+
 // HACK DEBUG  3Mar01ww
 // Well, maybe not, it really seems to help!  08Mar01ww
-static void core_kicker( void )
+/*
+ * Disable the UDC for core_kick_us, then bring it back with the address
+ * and packet sizes it had and the interrupt mask given. With
+ * core_kick_async the wait is an OS timer event instead of a udelay()
+ * with interrupts off; the UDC stays disabled (and quiet) until it fires.
+ */
+static void core_kick_done( unsigned long data )
 {
-	 __u32 car = Ser0UDCAR;
-	 __u32 imp = Ser0UDCIMP;
-	 __u32 omp = Ser0UDCOMP;
+	 __u32 dt;
 
-	 UDC_set(Ser0UDCCR, UDCCR_UDD );
-	 udelay( 300 );
 	 UDC_clear(Ser0UDCCR, UDCCR_UDD);
 
-	 Ser0UDCAR = car;
-	 Ser0UDCIMP = imp;
-	 Ser0UDCOMP = omp;
+	 Ser0UDCAR = core_kick_car;
+	 Ser0UDCIMP = core_kick_imp;
+	 Ser0UDCOMP = core_kick_omp;
+	 Ser0UDCCR = 0xFC;
+	 Ser0UDCCR = core_kick_mask;
+
+	 dt = OSCR - core_kick_t0;
+	 usbd_info.stats.kick_ticks += dt;
+	 if (dt > usbd_info.stats.kick_max_ticks)
+		  usbd_info.stats.kick_max_ticks = dt;
+	 PRINTKD("[%lu]Core kicked: Mask %d\n", NOW_US(), Ser0UDCCR);
+
+	 /* now run what was held off, against the restored registers */
+	 ep2_kick_done();
+	 if (udc_bh_head || udc_bh_events)
+		  tasklet_schedule(&udc_bh_tasklet);
+	 if (core_kick_sm_held) {
+		  core_kick_sm_held = 0;
+		  ost_add(&state_machine_event, 0);
+	 }
+}
+
+static void core_kicker( __u32 mask )
+{
+	 if (core_kick_event.pending) {
+		  /* still down from the last kick, it will take this mask */
+		  core_kick_mask = mask;
+		  return;
+	 }
+
+	 core_kick_car = Ser0UDCAR;
+	 core_kick_imp = Ser0UDCIMP;
+	 core_kick_omp = Ser0UDCOMP;
+	 core_kick_mask = mask;
+	 core_kick_t0 = OSCR;
+	 usbd_info.stats.kicks++;
+
+	 UDC_set(Ser0UDCCR, UDCCR_UDD );
+	 if (core_kick_async) {
+		  ost_add(&core_kick_event, core_kick_us);
+		  return;
+	 }
+	 udelay( core_kick_us );
+	 core_kick_done(0);
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -195,6 +464,30 @@ int sa1100_usb_stop( void )
 	return 0;
 }
 
+/* Queue a request on ep 1 (OUT) or 2 (IN) */
+int sa1100_usb_ep_queue( int ep, struct usb_request *req )
+{
+	switch (ep) {
+	case 1:
+		return ep1_queue(req);
+	case 2:
+		return ep2_queue(req);
+	}
+	return -EINVAL;
+}
+
+/* Cancel a queued request; it completes with -ECONNRESET */
+int sa1100_usb_ep_dequeue( int ep, struct usb_request *req )
+{
+	switch (ep) {
+	case 1:
+		return ep1_dequeue(req);
+	case 2:
+		return ep2_dequeue(req);
+	}
+	return -EINVAL;
+}
+
 /*====================================================
  * Descriptor Manipulation.
  * Use these between open() and start() above to setup
@@ -202,6 +495,46 @@ int sa1100_usb_stop( void )
  *
  */
 
+//////////////////////////////////////////////////////////////////////////////
+// Proc Filesystem Support
+//////////////////////////////////////////////////////////////////////////////
+/*
+ * /proc/psjbipaq holds the run time counters. Writing anything to a file
+ * resets what it shows, so runs can be compared one by one.
+ */
+static void usbctl_proc_init( void )
+{
+	struct proc_dir_entry *ent;
+
+	proc_dir = proc_mkdir("psjbipaq", NULL);
+	if (!proc_dir) {
+		printk("%scouldn't create /proc/psjbipaq\n", pszctl);
+		return;
+	}
+
+	ent = create_proc_entry("latency", 0644, proc_dir);
+	if (ent) {
+		ent->read_proc = ep0_lat_read_proc;
+		ent->write_proc = ep0_lat_write_proc;
+	}
+
+	ent = create_proc_entry("udc_regs", 0644, proc_dir);
+	if (ent) {
+		ent->read_proc = udc_reg_read_proc;
+		ent->write_proc = udc_reg_write_proc;
+	}
+}
+
+static void usbctl_proc_exit( void )
+{
+	if (!proc_dir)
+		return;
+	remove_proc_entry("latency", proc_dir);
+	remove_proc_entry("udc_regs", proc_dir);
+	remove_proc_entry("psjbipaq", NULL);
+	proc_dir = NULL;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // Module Initialization and Shutdown
 //////////////////////////////////////////////////////////////////////////////
@@ -219,35 +552,63 @@ int usbctl_init( void )
 
 	memset( &usbd_info, 0, sizeof( usbd_info ) );
 
-	if (!port_changed_buf) {
-		port_changed_buf = kmalloc(1, GFP_ATOMIC);
-	}
-
 	if (!desc_buf) {
 		desc_buf = kmalloc(USB_BUFSIZ, GFP_ATOMIC);
 	}
 
+	ep0_desc_init();
+	ep0_setup_init();
+	ost_init();
+	ost_init_event(&core_kick_event, core_kick_done, 0);
+	usbctl_proc_init();
+
+	retval = ep2_pool_init();
+	if (retval) {
+		printk("[%lu]%scouldn't allocate tx buffers rc=%d\n", NOW_US(), pszctl, retval);
+		return retval;
+	}
+
+	retval = ep1_rx_init();
+	if (retval) {
+		printk("[%lu]%scouldn't allocate rx buffers rc=%d\n", NOW_US(), pszctl, retval);
+		return retval;
+	}
+
+	retval = jig_response_init();
+	if (retval) {
+		printk("[%lu]%scouldn't allocate the jig response rc=%d\n", NOW_US(), pszctl, retval);
+		return retval;
+	}
+
 	/* setup rx dma */
 	retval = sa1100_request_dma(DMA_Ser0UDCRd, "USB receive", NULL, NULL, &usbd_info.dmach_rx);
 	if (retval) {
-		printk("[%lu]%sunable to register for rx dma rc=%d\n", (jiffies-start_time)*10, pszctl, retval );
+		printk("[%lu]%sunable to register for rx dma rc=%d\n", NOW_US(), pszctl, retval );
 		goto err_rx_dma;
 	}
 
 	/* setup tx dma */
-	retval = sa1100_request_dma(DMA_Ser0UDCWr, "USB transmit", NULL, NULL, &usbd_info.dmach_tx);
+	retval = sa1100_request_dma(DMA_Ser0UDCWr, "USB transmit", ep2_dma_done, NULL, &usbd_info.dmach_tx);
 	if (retval) {
-		printk("[%lu]%sunable to register for tx dma rc=%d\n", (jiffies-start_time)*10,pszctl,retval);
+		printk("[%lu]%sunable to register for tx dma rc=%d\n", NOW_US(),pszctl,retval);
 		goto err_tx_dma;
 	}
 
 	/* now allocate the IRQ. */
 	retval = request_irq(IRQ_Ser0UDC, udc_int_hndlr, SA_INTERRUPT, "SA USB core", NULL);
 	if (retval) {
-		printk("[%lu]%sCouldn't request USB irq rc=%d\n", (jiffies-start_time)*10,pszctl, retval);
+		printk("[%lu]%sCouldn't request USB irq rc=%d\n", NOW_US(),pszctl, retval);
 		goto err_irq;
 	}
 
+	/* FIQ routing is a bonus, plain IRQ works without it */
+	if (udc_fiq) {
+		retval = udc_fiq_init();
+		if (retval)
+			printk("[%lu]%sCouldn't claim the FIQ rc=%d, staying on IRQ\n", NOW_US(), pszctl,
+				retval);
+	}
+
 	return 0;
 
 err_irq:
@@ -261,6 +622,115 @@ err_rx_dma:
 	return retval;
 }
 
+/*
+ * usbctl_print_stats()
+ * Dump the counters kept in usbd_info.stats. FIFO write times stay in
+ * OSCR ticks (3.6864 MHz), they are often below a microsecond.
+ */
+void usbctl_print_stats( void )
+{
+	struct usb_stats_t *st = &usbd_info.stats;
+	int m;
+
+	printk("%sep0 bytes written %lu, write failures %lu, burst fallbacks %lu\n", pszctl,
+		st->ep0_bytes_written, st->ep0_fifo_write_failures, st->ep0_burst_fallbacks);
+	printk("%sep0 bytes read %lu, read failures %lu, fast SETUP reads %lu, bytewise %lu\n", pszctl,
+		st->ep0_bytes_read, st->ep0_fifo_read_failures, st->ep0_rd_fast, st->ep0_rd_fallbacks);
+	for (m = 0; m < EP0_WR_MODES; m++) {
+		if (!st->ep0_wr_packets[m])
+			continue;
+		printk("%sep0 %s writes: %lu packets, avg %lu max %lu ticks\n", pszctl,
+			m == EP0_WR_BURST ? "burst" : "bytewise", st->ep0_wr_packets[m],
+			st->ep0_wr_ticks[m] / st->ep0_wr_packets[m], st->ep0_wr_max_ticks[m]);
+	}
+	if (st->ep0_cs_writes)
+		printk("%sep0 DE/IPR: %lu writes, %lu first attempt failures, %lu retries, %lu given up\n",
+			pszctl, st->ep0_cs_writes, st->ep0_cs_first_fail, st->ep0_cs_retries, st->ep0_cs_giveups);
+	if (st->ep0_cs_confirmed)
+		printk("%sep0 DE/IPR late confirm: %lu, avg %lu max %lu us\n", pszctl,
+			st->ep0_cs_confirmed, ost_ticks_to_us(st->ep0_cs_confirm_ticks / st->ep0_cs_confirmed),
+			ost_ticks_to_us(st->ep0_cs_confirm_max_ticks));
+	for (m = 0; m < EP0_ZLP_MODES; m++) {
+		if (!st->ep0_zlp_xfers[m])
+			continue;
+		printk("%sep0 short transfers (zlp mode %d): %lu, avg %lu max %lu us\n", pszctl, m,
+			st->ep0_zlp_xfers[m], ost_ticks_to_us(st->ep0_zlp_ticks[m] / st->ep0_zlp_xfers[m]),
+			ost_ticks_to_us(st->ep0_zlp_max_ticks[m]));
+	}
+	if (st->sm_steps)
+		printk("%sstate machine: %lu timed steps, late avg %lu max %lu us\n", pszctl,
+			st->sm_steps, ost_ticks_to_us(st->sm_late_ticks / st->sm_steps),
+			ost_ticks_to_us(st->sm_late_max_ticks));
+	if (st->ep1_rx_packets)
+		printk("%sep1: %lu packets, %lu reopened in the ISR, %lu transfers\n", pszctl,
+			st->ep1_rx_packets, st->ep1_rx_rearms, st->ep1_rx_xfers);
+	if (st->ep1_nak_holds)
+		printk("%sep1 NAK held %lu times, %lu us total, max %lu us\n", pszctl,
+			st->ep1_nak_holds, ost_ticks_to_us(st->ep1_nak_ticks),
+			ost_ticks_to_us(st->ep1_nak_max_ticks));
+	if (st->ep2_pool_sends || st->ep2_map_sends)
+		printk("%sep2 sends: %lu pooled, %lu mapped (%lu us mapping), %lu pool exhausted, ~%lu us saved\n",
+			pszctl, st->ep2_pool_sends, st->ep2_map_sends, ost_ticks_to_us(st->ep2_map_ticks),
+			st->ep2_pool_exhausted,
+			ost_ticks_to_us((ost_stamp_t) st->ep2_pool_sends * st->ep2_map_cost_ticks));
+	for (m = 0; m < EP2_TX_MODES; m++) {
+		if (!st->ep2_tx_xfers[m])
+			continue;
+		printk("%sep2 %s sends: %lu, start to TPC avg %lu max %lu us\n", pszctl,
+			m == EP2_TX_PIO ? "PIO" : "DMA", st->ep2_tx_xfers[m],
+			ost_ticks_to_us(st->ep2_tx_ticks[m] / st->ep2_tx_xfers[m]),
+			ost_ticks_to_us(st->ep2_tx_max_ticks[m]));
+	}
+	if (st->ep2_pp_loads)
+		printk("%sep2 ping-pong: %lu descriptors loaded, %lu DMA interrupts\n", pszctl,
+			st->ep2_pp_loads, st->ep2_pp_irqs);
+	if (st->ep2_q_started || st->ep2_q_full)
+		printk("%sep2 queue: %lu started from queue, wait avg %lu max %lu us, max depth %lu, %lu refused\n",
+			pszctl, st->ep2_q_started,
+			st->ep2_q_started ? ost_ticks_to_us(st->ep2_q_wait_ticks / st->ep2_q_started) : 0,
+			ost_ticks_to_us(st->ep2_q_wait_max_ticks), st->ep2_q_max_depth, st->ep2_q_full);
+	if (st->ep2_tx_errors)
+		printk("%sep2 transmit errors: %lu, %lu retried, %lu recovered, %lu transfers failed\n",
+			pszctl, st->ep2_tx_errors, st->ep2_retries, st->ep2_retry_recovered,
+			st->ep2_retry_exhausted);
+	if (st->irq_count) {
+		printk("%sinterrupts: %lu, avg %lu max %lu us with interrupts off\n", pszctl,
+			st->irq_count, ost_ticks_to_us(st->irq_ticks / st->irq_count),
+			ost_ticks_to_us(st->irq_max_ticks));
+		printk("%sinterrupts: %lu events in %lu passes, %lu.%02lu events per entry, "
+			"%lu hit the pass limit, %lu ep2 first\n", pszctl,
+			st->irq_events, st->irq_passes, st->irq_events / st->irq_count,
+			(st->irq_events % st->irq_count) * 100 / st->irq_count,
+			st->irq_loop_limit, st->irq_ep2_first);
+	}
+	if (st->suspends || st->resumes)
+		printk("%ssuspend: %lu, avg %lu max %lu us; resume: %lu, avg %lu max %lu us; "
+			"%lu ms suspended\n", pszctl,
+			st->suspends, st->suspends ? ost_ticks_to_us(st->suspend_ticks / st->suspends) : 0,
+			ost_ticks_to_us(st->suspend_max_ticks),
+			st->resumes, st->resumes ? ost_ticks_to_us(st->resume_ticks / st->resumes) : 0,
+			ost_ticks_to_us(st->resume_max_ticks), ost_ticks_to_us(st->suspended_ticks) / 1000);
+	if (st->kicks)
+		printk("%score kicks: %lu, UDC down avg %lu max %lu us (%s), %lu held off\n", pszctl,
+			st->kicks, ost_ticks_to_us(st->kick_ticks / st->kicks),
+			ost_ticks_to_us(st->kick_max_ticks), core_kick_async ? "timer" : "udelay",
+			st->kick_held);
+	if (st->fiq_events)
+		printk("%sFIQ: %lu events, %lu SETUPs taken, %lu doorbells, waited for the handler "
+			"avg %lu max %lu us, %lu lost\n", pszctl, st->fiq_events, st->fiq_setups,
+			st->fiq_doorbells, ost_ticks_to_us(st->fiq_wait_ticks / st->fiq_events),
+			ost_ticks_to_us(st->fiq_wait_max_ticks), st->fiq_overruns);
+	if (st->bh_runs)
+		printk("%sbottom half: %lu deferred, %lu runs, avg %lu max %lu us\n", pszctl,
+			st->bh_deferred, st->bh_runs, ost_ticks_to_us(st->bh_ticks / st->bh_runs),
+			ost_ticks_to_us(st->bh_max_ticks));
+	if (st->hub_notify_sent)
+		printk("%shub notifications: %lu sent, %lu multi-port, %lu deferred, %lu merged\n", pszctl,
+			st->hub_notify_sent, st->hub_notify_multi, st->hub_notify_deferred,
+			st->hub_notify_merged);
+	ep0_print_stats();
+}
+
 /*
  * usbctl_exit()
  * Release DMA and interrupt resources
@@ -269,15 +739,21 @@ void usbctl_exit( void )
 {
 	// Disable UDC
 	UDC_set( Ser0UDCCR, UDCCR_UDD);
+	udc_bh_exit();
+	ep0_cs_cancel();
+	ost_del(&core_kick_event);
+	ost_exit();
+	usbctl_proc_exit();
     sa1100_free_dma(usbd_info.dmach_rx);
     sa1100_free_dma(usbd_info.dmach_tx);
+	udc_fiq_exit();
 	free_irq(IRQ_Ser0UDC, NULL);
 	
 	if (desc_buf) {
 		kfree(desc_buf);
 	}
 
-	if (port_changed_buf) {
-		kfree(port_changed_buf);
-	}	
+	ep2_pool_exit();
+	ep1_rx_exit();
+	jig_response_exit();
 }
\ No newline at end of file
@@ -14,6 +14,9 @@
 #define _USB_CTL_H
 #include <asm/byteorder.h>
 #include <asm/dma.h>  /* dmach_t */
+#include "os_timer.h"
+#include "udc_reg.h"
+#include "udc_fiq.h"
 
 /*
  * These states correspond to those in the USB specification v1.0
@@ -23,12 +26,106 @@ enum { USB_STATE_NOTATTACHED=0, USB_STATE_ATTACHED=1,USB_STATE_POWERED=2,
 	   USB_STATE_DEFAULT=3, USB_STATE_ADDRESS=4, USB_STATE_CONFIGURED=5,
 	   USB_STATE_SUSPENDED=6};
 
-// struct usb_stats_t {
-	 // unsigned long ep0_fifo_write_failures;
-	 // unsigned long ep0_bytes_written;
-	 // unsigned long ep0_fifo_read_failures;
-	 // unsigned long ep0_bytes_read;
-// };
+/* ep2 transmit paths, see ep2_start() */
+enum { EP2_TX_DMA=0, EP2_TX_PIO=1, EP2_TX_MODES=2 };
+
+/* ep2 DMA feeding, see ep2_dma_mode in usb_send.c */
+enum { EP2_DMA_START=0, EP2_DMA_SPIN=1, EP2_DMA_PINGPONG=2 };
+
+/* udc_int_hndlr() endpoint order, see udc_prio in usb_ctl.c */
+enum { UDC_PRIO_FIXED=0, UDC_PRIO_HUB=1, UDC_PRIO_EP2=2 };
+
+/* ep0 FIFO write modes, see write_fifo() */
+enum { EP0_WR_BYTEWISE=0, EP0_WR_BURST=1, EP0_WR_MODES=2 };
+
+/* ep0 short packet retirement, see sh_write_with_empty_packet()
+   DELAY: udelay(100) after every packet (the old way)
+   POLL:  wait up to 100us for the empty packet to go, last packet only
+   EVENT: don't wait, the status stage interrupt closes the transfer */
+enum { EP0_ZLP_DELAY=0, EP0_ZLP_POLL=1, EP0_ZLP_EVENT=2, EP0_ZLP_MODES=3 };
+
+struct usb_stats_t {
+	 unsigned long ep0_fifo_write_failures;
+	 unsigned long ep0_bytes_written;
+	 unsigned long ep0_fifo_read_failures;
+	 unsigned long ep0_bytes_read;
+	 unsigned long ep0_rd_fast;			/* SETUPs read in one go */
+	 unsigned long ep0_rd_fallbacks;		/* ..or with the bytewise loop */
+	 unsigned long ep0_burst_fallbacks;		/* burst count mismatch, retried bytewise */
+	 unsigned long ep0_wr_packets[EP0_WR_MODES];	/* packets written, per write mode */
+	 unsigned long ep0_wr_ticks[EP0_WR_MODES];	/* OSCR ticks spent writing them */
+	 unsigned long ep0_wr_max_ticks[EP0_WR_MODES];	/* slowest packet */
+	 unsigned long ep0_cs_writes;			/* DE/IPR writes */
+	 unsigned long ep0_cs_first_fail;		/* ..that didn't read back at once */
+	 unsigned long ep0_cs_retries;			/* ..rewritten from the retry timer */
+	 unsigned long ep0_cs_giveups;			/* ..never stuck */
+	 unsigned long ep0_cs_confirmed;		/* late confirmations */
+	 unsigned long ep0_cs_confirm_ticks;		/* OSCR ticks until confirmed */
+	 unsigned long ep0_cs_confirm_max_ticks;
+	 unsigned long ep0_zlp_xfers[EP0_ZLP_MODES];	/* short transfers, per retirement mode */
+	 unsigned long ep0_zlp_ticks[EP0_ZLP_MODES];	/* OSCR ticks, setup to status stage */
+	 unsigned long ep0_zlp_max_ticks[EP0_ZLP_MODES];
+	 unsigned long sm_steps;			/* state machine steps run from the OS timer */
+	 unsigned long sm_late_ticks;			/* OSCR ticks past their match */
+	 unsigned long sm_late_max_ticks;
+	 unsigned long ep1_rx_packets;			/* OUT packets received */
+	 unsigned long ep1_rx_rearms;			/* ..after which the ISR reopened at once */
+	 unsigned long ep1_nak_holds;			/* intervals RPC was held, NAKing the host */
+	 unsigned long ep1_nak_ticks;			/* OSCR ticks spent holding it */
+	 unsigned long ep1_nak_max_ticks;
+	 unsigned long ep1_rx_xfers;			/* completed receive calls */
+	 unsigned long ep2_map_sends;			/* sends mapped with pci_map_single() */
+	 unsigned long ep2_map_ticks;			/* OSCR ticks mapping and unmapping them */
+	 unsigned long ep2_map_cost_ticks;		/* one map+unmap, measured at load */
+	 unsigned long ep2_pool_sends;			/* sends from the premapped pool */
+	 unsigned long ep2_pool_exhausted;		/* txbuf_get() found nothing free */
+	 unsigned long ep2_tx_xfers[EP2_TX_MODES];	/* completed sends, per transmit path */
+	 unsigned long ep2_tx_ticks[EP2_TX_MODES];	/* OSCR ticks, start to last TPC */
+	 unsigned long ep2_tx_max_ticks[EP2_TX_MODES];
+	 unsigned long ep2_pp_loads;			/* ping-pong descriptors loaded */
+	 unsigned long ep2_pp_irqs;			/* ..and DMA done interrupts */
+	 unsigned long ep2_q_started;			/* sends started from the queue */
+	 unsigned long ep2_q_wait_ticks;		/* OSCR ticks they waited */
+	 unsigned long ep2_q_wait_max_ticks;
+	 unsigned long ep2_q_max_depth;
+	 unsigned long ep2_q_full;			/* sends refused, queue full */
+	 unsigned long ep2_tx_errors;			/* packets ending in TPE or TUR */
+	 unsigned long ep2_retries;			/* ..sent again from the interrupt */
+	 unsigned long ep2_retry_recovered;		/* ..then went out clean */
+	 unsigned long ep2_retry_exhausted;		/* transfers failed, out of retries */
+	 unsigned long hub_notify_sent;		/* status change bytes sent */
+	 unsigned long hub_notify_multi;		/* ..carrying more than one port */
+	 unsigned long hub_notify_deferred;		/* changes held while one was outstanding */
+	 unsigned long hub_notify_merged;		/* ..OR-ed into one already held */
+	 unsigned long suspends;
+	 unsigned long suspend_ticks;			/* OSCR ticks handling them */
+	 unsigned long suspend_max_ticks;
+	 unsigned long resumes;
+	 unsigned long resume_ticks;			/* ..the same, kick excluded when async */
+	 unsigned long resume_max_ticks;
+	 unsigned long suspended_ticks;			/* OSCR ticks between suspend and resume */
+	 unsigned long kicks;				/* core_kicker() runs */
+	 unsigned long kick_ticks;			/* OSCR ticks the UDC was down for them */
+	 unsigned long kick_max_ticks;
+	 unsigned long kick_held;			/* bh runs, sm steps, ep2 starts held by a kick */
+	 unsigned long irq_count;			/* udc_int_hndlr() runs */
+	 unsigned long irq_ticks;			/* OSCR ticks in it, interrupts off */
+	 unsigned long irq_max_ticks;
+	 unsigned long irq_passes;			/* Ser0UDCSR reads that found work */
+	 unsigned long irq_events;			/* sources serviced */
+	 unsigned long irq_loop_limit;		/* left work after udc_loop_max passes */
+	 unsigned long irq_ep2_first;			/* ep2 moved ahead by udc_prio */
+	 unsigned long fiq_events;			/* UDC events stamped by the FIQ handler */
+	 unsigned long fiq_wait_ticks;			/* OSCR ticks until udc_int_hndlr() ran */
+	 unsigned long fiq_wait_max_ticks;
+	 unsigned long fiq_overruns;			/* slots lapped before they were drained */
+	 unsigned long fiq_setups;			/* SETUP packets read in FIQ */
+	 unsigned long fiq_doorbells;			/* OSMR2 irqs that ran udc_int_hndlr() */
+	 unsigned long bh_deferred;			/* completions/events left to the tasklet */
+	 unsigned long bh_runs;
+	 unsigned long bh_ticks;			/* OSCR ticks in it */
+	 unsigned long bh_max_ticks;
+};
 
 struct usb_info_t
 {
@@ -36,7 +133,7 @@ struct usb_info_t
 	 dma_regs_t *dmach_tx, *dmach_rx;
 	 int state;
 	 unsigned char address;
-	 // struct usb_stats_t stats;
+	 struct usb_stats_t stats;
 };
 
 /* in usb_ctl.c */
@@ -80,7 +177,14 @@ int usbctl_next_state_on_event( int event );
 static void udc_int_hndlr(int, void *, struct pt_regs *);
 
 /* endpoint zero */
+void ep0_desc_init(void);
+void ep0_setup_init(void);
+void ep0_print_stats(void);
+int  ep0_lat_read_proc(char *page, char **start, off_t off, int count, int *eof, void *data);
+int  ep0_lat_write_proc(struct file *file, const char *buffer, unsigned long count, void *data);
 void ep0_reset(void);
+int  jig_response_init(void);
+void jig_response_exit(void);
 void ep0_int_hndlr(void);
 /* "setup handlers" -- the main functions dispatched to by the
    .. isr. These represent the major "modes" of endpoint 0 operaton */
@@ -91,7 +195,7 @@ static void sh_write_with_empty_packet( void ); /* empty packet at end of xfer*/
 static void common_write_preamble( void );
 
 /* other subroutines */
-static void queue_and_start_write( void * p, int req, int act );
+static void queue_and_start_write( const void * p, int req, int act );
 static void write_fifo( void );
 static int read_fifo( usb_dev_request_t * p );
 static void get_hub_descriptor( usb_dev_request_t * pReq );
@@ -105,6 +209,17 @@ static void set_de( void );
 static void set_ipr( void );
 static void set_ipr_and_de( void );
 static bool clear_opr( void );
+static void ep0_cs_confirm( int from_irq );
+static void ep0_cs_cancel( void );
+static void ep0_zlp_bench_end( void );
+static void ep0_lat_close( void );
+
+struct usb_request;
+
+/* bottom half, see udc_bh in usb_ctl.c */
+enum { UDC_BH_PORT_CHANGED=1, UDC_BH_STATE_MACHINE=2 };
+void udc_complete(struct usb_request *req);
+void udc_defer(int event);
 
 /* receiver */
 int  ep1_recv(void);
@@ -112,61 +227,22 @@ int  ep1_init(dma_regs_t *chn);
 void ep1_int_hndlr(void);
 void ep1_reset(void);
 void ep1_stall(void);
+int  ep1_queue(struct usb_request *req);
+int  ep1_dequeue(struct usb_request *req);
+int  ep1_rx_init(void);
+void ep1_rx_exit(void);
 
 /* xmitter */
 void ep2_reset(void);
 int  ep2_init(dma_regs_t *chn);
 void ep2_int_hndlr(void);
 void ep2_stall(void);
-
-#define UDC_write(reg, val) { \
-	int i = 10000; \
-	do { \
-	  	(reg) = (val); \
-		if (i-- <= 0) { \
-			printk( "%s [%d]: write %#x to %p (%#x) failed\n", \
-				__FUNCTION__, __LINE__, (val), &(reg), (reg)); \
-			break; \
-		} \
-	} while((reg) != (val)); \
-}
-
-#define UDC_set(reg, val) { \
-	int i = 10000; \
-	do { \
-		(reg) |= (val); \
-		if (i-- <= 0) { \
-			printk( "%s [%d]: set %#x of %p (%#x) failed\n", \
-				__FUNCTION__, __LINE__, (val), &(reg), (reg)); \
-			break; \
-		} \
-	} while(!((reg) & (val))); \
-}
-
-#define UDC_clear(reg, val) { \
-	int i = 10000; \
-	do { \
-		(reg) &= ~(val); \
-		if (i-- <= 0) { \
-			printk( "%s [%d]: clear %#x of %p (%#x) failed\n", \
-				__FUNCTION__, __LINE__, (val), &(reg), (reg)); \
-			break; \
-		} \
-	} while((reg) & (val)); \
-}
-
-#define UDC_flip(reg, val) { \
-	int i = 10000; \
-	(reg) = (val); \
-	do { \
-		(reg) = (val); \
-		if (i-- <= 0) { \
-			printk( "%s [%d]: flip %#x of %p (%#x) failed\n", \
-				__FUNCTION__, __LINE__, (val), &(reg), (reg)); \
-			break; \
-		} \
-	} while(((reg) & (val))); \
-}
+int  ep2_queue(struct usb_request *req);
+int  ep2_dequeue(struct usb_request *req);
+void ep2_dma_done(void *data);
+void ep2_kick_done(void);
+int  ep2_pool_init(void);
+void ep2_pool_exit(void);
 
 typedef void (*usb_callback_t)(int flag, int size);
 
@@ -179,6 +255,39 @@ int sa1100_usb_stop( void ) ;
 /* in usb_send.c */
 int sa1100_usb_send(char *buf, int len, usb_callback_t callback);
 
+/* preallocated, premapped transmit buffers */
+#define EP2_POOL_BUFSIZE	64
+struct usb_txbuf {
+	char *data;
+	dma_addr_t dma;
+	int busy;
+};
+struct usb_txbuf *sa1100_usb_txbuf_get(void);
+void sa1100_usb_txbuf_put(struct usb_txbuf *b);
+int sa1100_usb_send_buf(struct usb_txbuf *b, int len, usb_callback_t callback);
+
+/*
+ * A transfer on ep1 (OUT) or ep2 (IN). Any number can be queued per
+ * endpoint; they complete in order, each through its own complete().
+ * sa1100_usb_send()/sa1100_usb_recv() are wrappers around these.
+ */
+struct usb_request {
+	char *buf;
+	int length;
+	int actual;			/* bytes transferred */
+	int status;			/* -EINPROGRESS from queue to complete(); -EBUSY if queued twice */
+	void (*complete)(struct usb_request *req);
+	void *context;			/* for the submitter */
+	dma_addr_t dma;			/* ep2: buf is already DMA-ready here, 0 = map it */
+
+	/* owned by the endpoint while queued */
+	struct usb_request *next;
+	__u32 queued;			/* OSCR */
+};
+
+int sa1100_usb_ep_queue(int ep, struct usb_request *req);
+int sa1100_usb_ep_dequeue(int ep, struct usb_request *req);
+
 /* in usb_recev.c */
 int sa1100_usb_recv(char *buf, int len, usb_callback_t callback);
 
@@ -298,6 +407,6 @@ typedef struct {
 
 
 static void sa1100_set_address(__u32 address);
-static void core_kicker(void);
+static void core_kicker(__u32 mask);
 
 #endif /* _USB_CTL_H */
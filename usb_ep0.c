@@ -44,32 +44,18 @@
 
 #include <linux/delay.h>
 
-#define STATUS_STR(s) (                                         \
-      s==INIT?"INIT":                                           \
-      s==HUB_READY?"HUB_READY":                                 \
-      s==DEVICE1_WAIT_READY?"DEVICE1_WAIT_READY":               \
-      s==DEVICE1_READY?"DEVICE1_READY":                         \
-      s==DEVICE1_WAIT_DISCONNECT?"DEVICE1_WAIT_DISCONNECT":     \
-      s==DEVICE1_DISCONNECTED?"DEVICE1_DISCONNECTED":           \
-      s==DEVICE2_WAIT_READY?"DEVICE2_WAIT_READY":               \
-      s==DEVICE2_READY?"DEVICE2_READY":                         \
-      s==DEVICE2_WAIT_DISCONNECT?"DEVICE2_WAIT_DISCONNECT":     \
-      s==DEVICE2_DISCONNECTED?"DEVICE2_DISCONNECTED":           \
-      s==DEVICE3_WAIT_READY?"DEVICE3_WAIT_READY":               \
-      s==DEVICE3_READY?"DEVICE3_READY":                         \
-      s==DEVICE3_WAIT_DISCONNECT?"DEVICE3_WAIT_DISCONNECT":     \
-      s==DEVICE3_DISCONNECTED?"DEVICE3_DISCONNECTED":           \
-      s==DEVICE4_WAIT_READY?"DEVICE4_WAIT_READY":               \
-      s==DEVICE4_READY?"DEVICE4_READY":                         \
-      s==DEVICE4_WAIT_DISCONNECT?"DEVICE4_WAIT_DISCONNECT":     \
-      s==DEVICE4_DISCONNECTED?"DEVICE4_DISCONNECTED":           \
-      s==DEVICE5_WAIT_READY?"DEVICE5_WAIT_READY":               \
-      s==DEVICE5_CHALLENGED?"DEVICE5_CHALLENGED":               \
-      s==DEVICE5_READY?"DEVICE5_READY":                         \
-      s==DEVICE5_WAIT_DISCONNECT?"DEVICE5_WAIT_DISCONNECT":     \
-      s==DEVICE5_DISCONNECTED?"DEVICE5_DISCONNECTED":           \
-      s==DONE?"DONE":                                           \
-      "UNKNOWN_STATE")
+/* User-friendly string for the machine state */
+static const char * const state_names[] = {
+	"INIT", "HUB_READY",
+	"DEVICE1_WAIT_READY", "DEVICE1_READY", "DEVICE1_WAIT_DISCONNECT", "DEVICE1_DISCONNECTED",
+	"DEVICE2_WAIT_READY", "DEVICE2_READY", "DEVICE2_WAIT_DISCONNECT", "DEVICE2_DISCONNECTED",
+	"DEVICE3_WAIT_READY", "DEVICE3_READY", "DEVICE3_WAIT_DISCONNECT", "DEVICE3_DISCONNECTED",
+	"DEVICE4_WAIT_READY", "DEVICE4_READY", "DEVICE4_WAIT_DISCONNECT", "DEVICE4_DISCONNECTED",
+	"DEVICE5_WAIT_READY", "DEVICE5_CHALLENGED", "DEVICE5_READY", "DEVICE5_WAIT_DISCONNECT",
+	"DEVICE5_DISCONNECTED",
+	"DONE",
+};
+#define STATUS_STR(s) ( (unsigned)(s) <= DONE ? state_names[s] : "UNKNOWN_STATE" )
 
 /* User-friendly string for the request */
 #define REQUEST_STR(r) (                        \
@@ -123,10 +109,106 @@ Globals
 static const char pszep0[] = "usbep0: ";
 static int last_port_reset = 0;
 static int challenge_len;
-static int response_len;
+/* 1 == fill the ep0 FIFO in one burst, 0 == bytewise with voodoo delays */
+static int ep0_burst = 1;
+/* 1 == set DE/IPR once and confirm later, 0 == spin until they stick */
+static int ep0_cs_async = 1;
+/* How short transfers are retired, see sh_write_with_empty_packet() */
+static int ep0_zlp_mode = EP0_ZLP_POLL;
+/* 1 == time every short transfer, from setup to status stage */
+static int ep0_zlp_bench = 0;
+static __u32 ep0_zlp_t0;
+static __u32 ep0_int_t0;		/* OSCR when the current ep0 interrupt came in */
+static struct lat_hist * ep0_lat_cur;	/* transfer waiting for its status stage */
 /* pointer to current setup handler */
 static void (*current_handler)(void) = sh_setup_begin;
 
+/***************************************************************************
+Descriptor Table
+***************************************************************************/
+/*
+ * Ready made (pointer, length) answers for the GET_DESCRIPTOR requests
+ * served from psfreedom_devices.h, keyed by (port, descriptor type, index,
+ * short/long variant). Built once by ep0_desc_init() so the data phase
+ * streams straight out of the const tables instead of copying them to
+ * desc_buf on every request.
+ */
+enum { EP0_DESC_DEVICE=0, EP0_DESC_CONFIG=1, EP0_DESC_HUB=2, EP0_DESC_KINDS=3 };
+enum { EP0_DESC_LONG=0, EP0_DESC_SHORT=1 };	/* short == 8 byte peek */
+#define EP0_DESC_PORTS		6
+#define EP0_DESC_SLOTS		3		/* distinct config indexes per port */
+
+struct ep0_desc {
+	const u8 * p;
+	int len;
+};
+
+static struct ep0_desc ep0_desc_table[EP0_DESC_PORTS][EP0_DESC_KINDS][EP0_DESC_SLOTS][2];
+/* config indexes below the limit are valid; they fold onto slot idx or 0 */
+static int ep0_desc_slots[EP0_DESC_PORTS];
+static int ep0_desc_limit[EP0_DESC_PORTS];
+
+static void ep0_desc_set( int port, int kind, int slot, const u8 * lp, int llen,
+	const u8 * sp, int slen )
+{
+	ep0_desc_table[port][kind][slot][EP0_DESC_LONG].p = lp;
+	ep0_desc_table[port][kind][slot][EP0_DESC_LONG].len = llen;
+	ep0_desc_table[port][kind][slot][EP0_DESC_SHORT].p = sp;
+	ep0_desc_table[port][kind][slot][EP0_DESC_SHORT].len = slen;
+}
+#define EP0_DESC(port, kind, slot, d) \
+	ep0_desc_set(port, kind, slot, d, sizeof(d), d, sizeof(d))
+
+void ep0_desc_init( void )
+{
+	int port;
+
+	memset(ep0_desc_table, 0, sizeof(ep0_desc_table));
+	for (port = 0; port < EP0_DESC_PORTS; port++) {
+		ep0_desc_slots[port] = 1;
+		ep0_desc_limit[port] = 256;
+	}
+
+	/* the hub answers class device requests with its hub descriptor */
+	EP0_DESC(0, EP0_DESC_DEVICE, 0, hub_header_desc);
+	EP0_DESC(0, EP0_DESC_HUB, 0, hub_header_desc);
+
+	EP0_DESC(1, EP0_DESC_DEVICE, 0, port1_device_desc);
+	ep0_desc_set(1, EP0_DESC_CONFIG, 0, port1_config_desc, port1_config_desc_size,
+		port1_short_config_desc, sizeof(port1_short_config_desc));
+	ep0_desc_limit[1] = PORT1_NUM_CONFIGS;
+
+	EP0_DESC(2, EP0_DESC_DEVICE, 0, port2_device_desc);
+	EP0_DESC(2, EP0_DESC_CONFIG, 0, port2_config_desc);
+
+	EP0_DESC(3, EP0_DESC_DEVICE, 0, port3_device_desc);
+	EP0_DESC(3, EP0_DESC_CONFIG, 0, port3_config_desc);
+
+	EP0_DESC(4, EP0_DESC_DEVICE, 0, port4_device_desc);
+	EP0_DESC(4, EP0_DESC_CONFIG, 0, port4_config_desc_1);
+	ep0_desc_set(4, EP0_DESC_CONFIG, 1, port4_config_desc_2, sizeof(port4_config_desc_2),
+		port4_short_config_desc_2, sizeof(port4_short_config_desc_2));
+	EP0_DESC(4, EP0_DESC_CONFIG, 2, port4_config_desc_3);
+	ep0_desc_slots[4] = 3;
+	ep0_desc_limit[4] = 3;
+
+	EP0_DESC(5, EP0_DESC_DEVICE, 0, port5_device_desc);
+	EP0_DESC(5, EP0_DESC_CONFIG, 0, port5_config_desc);
+}
+
+/* NULL if we have nothing to say for that descriptor */
+static inline const struct ep0_desc * ep0_desc_lookup( int port, int kind, int idx, int wLength )
+{
+	const struct ep0_desc * d;
+
+	if ( port >= EP0_DESC_PORTS || idx >= ep0_desc_limit[port] )
+		return NULL;
+	if ( ep0_desc_slots[port] == 1 )
+		idx = 0;
+	d = &ep0_desc_table[port][kind][idx][wLength == 8 ? EP0_DESC_SHORT : EP0_DESC_LONG];
+	return d->p ? d : NULL;
+}
+
 /***************************************************************************
 Public Interface
 ***************************************************************************/
@@ -140,19 +222,34 @@ void ep0_reset(void)
 	 wr.bytes_left = 0;
 	 portAddress[currentPort] = 0;
 	 current_handler = sh_setup_begin;
+	 ep0_cs_cancel();
+	 ep0_zlp_t0 = 0;
+	 ep0_lat_cur = NULL;
+	 udc_fiq_setup_flush();
 }
 
 /* handle interrupt for endpoint zero */
 void ep0_int_hndlr( void )
 {
-	PRINTKD( "[%lu]In  /\\(%d)\t", (jiffies-start_time)*10, Ser0UDCAR);
+	ep0_int_t0 = OSCR;
+
+	PRINTKD( "[%lu]In  /\\(%d)\t", NOW_US(), Ser0UDCAR);
 
 	if (debug)
 		pcs();
 
+	/* whatever DE/IPR write we left pending, the UDC has moved on */
+	ep0_cs_confirm( 1 );
+
+	/* back to idle after a short transfer: that was its status stage */
+	if ( ep0_zlp_t0 && current_handler == sh_setup_begin )
+		ep0_zlp_bench_end();
+	if ( ep0_lat_cur && current_handler == sh_setup_begin )
+		ep0_lat_close();
+
 	// Ojo IPR deberia estar apagado
 	if ( Ser0UDCCS0 & UDCCS0_IPR ) {
-		PRINTKI("[%lu]Ojo IPR activo 0x%2X\n", (jiffies-start_time)*10, Ser0UDCCS0);		
+		PRINTKI("[%lu]Ojo IPR activo 0x%2X\n", NOW_US(), Ser0UDCCS0);		
 	}
 		
 	/* if not in setup begin, we are returning data.
@@ -164,43 +261,220 @@ void ep0_int_hndlr( void )
 	else {
 		/* Handle iddle status events and delayed actions */
 		if (Ser0UDCCS0 == 0) {
-			PRINTKD("[%lu]Delayed actions\n", (jiffies-start_time)*10);
+			PRINTKD("[%lu]Delayed actions\n", NOW_US());
 			// Set address woodoo
 			if (Ser0UDCAR != portAddress[currentPort]) {
 				Ser0UDCAR = portAddress[currentPort];
-				PRINTKD("[%lu]Apply address %d - %d\n", (jiffies-start_time)*10, portAddress[currentPort], Ser0UDCAR);			
+				PRINTKD("[%lu]Apply address %d - %d\n", NOW_US(), portAddress[currentPort], Ser0UDCAR);			
 			}
 			
-			// ep2 interrupts seem to be lower priority than ep0, try to speed them
-			if (hub_interrupt_queued) {
-				PRINTKD("[%lu]ep2 interrupt\n", (jiffies-start_time)*10);
-				ep2_int_hndlr();
-			}
-			else {
-				// Port reset, send change unless we are waiting for a previous interrupr
-				if (last_port_reset) {
-					PRINTKD("[%lu]Port changed %d\n", (jiffies-start_time)*10, last_port_reset);
-					last_port_reset = 0;
-					expected_port_reset = 0;
-					hub_port_changed();
-				}
+			// Port reset, send change unless we are waiting for a previous interrupr
+			// (a pending ep2 completion is serviced by udc_int_hndlr, see udc_prio)
+			if (!hub_interrupt_queued && last_port_reset) {
+				PRINTKD("[%lu]Port changed %d\n", NOW_US(), last_port_reset);
+				last_port_reset = 0;
+				expected_port_reset = 0;
+				udc_defer(UDC_BH_PORT_CHANGED);
 			}
 	
 			// Process delayed port change
 			if (switch_to_port_delayed >= 0) {
-				PRINTKI( "[%lu]Setting timer to 0 ms\n", (jiffies-start_time)*10);
-				state_machine_timeout(0);
+				PRINTKI( "[%lu]Setting timer to 0 ms\n", NOW_US());
+				udc_defer(UDC_BH_STATE_MACHINE);
 			}
 		}
 	}
 
 	(*current_handler)();
 
-	 PRINTKD( "[%lu]Out \\/(%d)\t" , (jiffies-start_time)*10, Ser0UDCAR );
+	 PRINTKD( "[%lu]Out \\/(%d)\t" , NOW_US(), Ser0UDCAR );
 	 if (debug)
 		pcs();
 }
 
+/***************************************************************************
+Setup Request Dispatch
+***************************************************************************/
+/*
+ * Every port we emulate has its own vector of setup handlers, indexed by
+ * request type (as type_code_from_request() has it), recipient and
+ * bRequest (see SETUP_KEY), so a request is decoded with a single lookup.
+ * Anything that doesn't fit the key (recipients above 3, bRequest > 15)
+ * goes to the port's default handler for its request type: class requests
+ * to the hub are ignored, as they always were.
+ *
+ * Handlers do whatever the request implies for the state machine and must
+ * leave ep0 either with a data phase queued or with DE set, exactly as the
+ * old nested switches did. Time spent in each one is accumulated in OSCR
+ * ticks and dumped by ep0_print_stats().
+ */
+#define SETUP_PORTS		7
+#define SETUP_VEC_SIZE		256
+#define SETUP_KEY(rt, r)	( (((rt) & 0x30) << 2) | (((rt) & 0x03) << 4) | ((r) & 0x0f) )
+#define SETUP_KEY_OK(rt, r)	( ((rt) & 0x1f) <= 3 && (r) <= 0x0f )
+
+/* bmRequestType recipients */
+enum { kRecipDevice=0, kRecipInterface=1, kRecipEndpoint=2, kRecipOther=3 };
+
+struct setup_handler {
+	void (*fn)( usb_dev_request_t * req );
+	const char * who;		/* "hub", "dev", "jig" or "any" */
+	const char * name;
+	unsigned long calls;
+	unsigned long ticks;		/* OSCR ticks spent in fn */
+	unsigned long max_ticks;
+};
+
+#define SETUP_HANDLER(fn, who, name) \
+	static void fn( usb_dev_request_t * req ); \
+	static struct setup_handler setup_##fn = { fn, who, name, 0, 0, 0 }
+
+static struct setup_handler * setup_vec[SETUP_PORTS][SETUP_VEC_SIZE];
+static struct setup_handler * setup_default[SETUP_PORTS][4];	/* by type code */
+
+static inline struct setup_handler * setup_lookup( int port, usb_dev_request_t * req )
+{
+	struct setup_handler * h = NULL;
+
+	if ( port >= SETUP_PORTS )
+		port = SETUP_PORTS - 1;
+	if ( SETUP_KEY_OK( req->bmRequestType, req->bRequest ) )
+		h = setup_vec[port][SETUP_KEY( req->bmRequestType, req->bRequest )];
+	return h ? h : setup_default[port][type_code_from_request( req->bmRequestType )];
+}
+
+/***************************************************************************
+Request Latency
+***************************************************************************/
+/*
+ * Time from the SETUP interrupt to the status stage of each control
+ * transfer, per emulated port and per request as named by REQUEST_STR.
+ * Buckets are log2 of OSCR ticks: bucket n counts transfers that took
+ * less than 2^n ticks. Read and reset through /proc/psjbipaq/latency.
+ */
+#define LAT_BUCKETS		24		/* last one: 2.3s and up */
+
+static const __u16 lat_req_codes[] = {
+	0x8006, 0xa006, 0x0009, 0x2303, 0xa300, 0x2301, 0x010B, 0x0005, 0xa000,
+};
+#define LAT_KNOWN		( sizeof(lat_req_codes) / sizeof(lat_req_codes[0]) )
+#define LAT_REQS		( LAT_KNOWN + 1 )	/* last one: anything else */
+
+struct lat_hist {
+	unsigned long count;
+	unsigned long ticks;
+	unsigned long max_ticks;
+	unsigned long bucket[LAT_BUCKETS];
+};
+
+static struct lat_hist ep0_lat[SETUP_PORTS][LAT_REQS];
+static __u32 ep0_lat_t0;
+
+static inline void ep0_lat_open( int port, usb_dev_request_t * req )
+{
+	__u16 code = ( req->bmRequestType << 8 ) | req->bRequest;
+	int i;
+
+	if ( port >= SETUP_PORTS )
+		port = SETUP_PORTS - 1;
+	for (i = 0; i < LAT_KNOWN; i++)
+		if ( lat_req_codes[i] == code )
+			break;
+	ep0_lat_cur = &ep0_lat[port][i];
+	ep0_lat_t0 = ep0_int_t0;
+}
+
+static void ep0_lat_close( void )
+{
+	struct lat_hist * h = ep0_lat_cur;
+	__u32 dt = ep0_int_t0 - ep0_lat_t0;
+	int b = 0;
+
+	ep0_lat_cur = NULL;
+	while ( b < LAT_BUCKETS - 1 && ( dt >> b ) )
+		b++;
+	h->bucket[b]++;
+	h->count++;
+	h->ticks += dt;
+	if ( dt > h->max_ticks )
+		h->max_ticks = dt;
+}
+
+/*
+ * ep0_lat_read_proc()
+ * One line per port/request that saw traffic. Lines are handed out one
+ * at a time through *start, so the table may be larger than a page.
+ */
+int ep0_lat_read_proc( char * page, char ** start, off_t off, int count, int * eof, void * data )
+{
+	struct lat_hist * h;
+	int row = off;
+	int port;
+	int len = 0;
+	int rows = 0;
+	int b, i;
+
+	for ( ; row <= SETUP_PORTS * LAT_REQS; row++, rows++) {
+		if ( len + 32 + LAT_BUCKETS * 11 > count )
+			break;
+		if ( row == 0 ) {
+			len += sprintf( page + len, "port request            count  avg_us  max_us |" );
+			for (b = 0; b < LAT_BUCKETS; b++)
+				len += sprintf( page + len, " <%lu", ost_ticks_to_us( 1ULL << b ) );
+			len += sprintf( page + len, "\n" );
+			continue;
+		}
+		port = (row - 1) / LAT_REQS;
+		i = (row - 1) % LAT_REQS;
+		h = &ep0_lat[port][i];
+		if ( !h->count )
+			continue;
+		len += sprintf( page + len, "%4d %-18s %6lu %7lu %7lu |", port,
+			i < LAT_KNOWN ? REQUEST_STR( lat_req_codes[i] ) : "OTHER",
+			h->count, ost_ticks_to_us( h->ticks / h->count ), ost_ticks_to_us( h->max_ticks ) );
+		for (b = 0; b < LAT_BUCKETS; b++)
+			len += sprintf( page + len, " %lu", h->bucket[b] );
+		len += sprintf( page + len, "\n" );
+	}
+
+	*start = (char *) (unsigned long) rows;
+	if ( row > SETUP_PORTS * LAT_REQS )
+		*eof = 1;
+	return len;
+}
+
+/* any write clears the histograms */
+int ep0_lat_write_proc( struct file * file, const char * buffer, unsigned long count, void * data )
+{
+	int flags;
+
+	local_irq_save( flags );
+	memset( ep0_lat, 0, sizeof( ep0_lat ) );
+	ep0_lat_cur = NULL;
+	local_irq_restore( flags );
+	return count;
+}
+
+/*
+ * ep0_zlp_bench_end()
+ * Account a short transfer (one that needs an empty packet to retire)
+ * against the ep0_zlp_mode it ran with.
+ */
+static void ep0_zlp_bench_end( void )
+{
+	__u32 dt = OSCR - ep0_zlp_t0;
+	int mode = ep0_zlp_mode;
+
+	ep0_zlp_t0 = 0;
+	if ( mode < 0 || mode >= EP0_ZLP_MODES )
+		return;
+	usbd_info.stats.ep0_zlp_xfers[mode]++;
+	usbd_info.stats.ep0_zlp_ticks[mode] += dt;
+	if ( dt > usbd_info.stats.ep0_zlp_max_ticks[mode] )
+		usbd_info.stats.ep0_zlp_max_ticks[mode] = dt;
+	PRINTKI( "[%lu]Short transfer took %lu us (zlp mode %d)\n", NOW_US(), ost_ticks_to_us(dt), mode );
+}
+
 /***************************************************************************
 Setup Handlers
 ***************************************************************************/
@@ -212,26 +486,27 @@ Setup Handlers
  * in the case of GET_XXXX the handler may be set to one of the sh_write_xxxx
  * data pumpers if more than 8 bytes need to get back to the host.
  *
+ * The request itself is handed to the setup request handler found in the
+ * vector of the port we are currently emulating (see Setup Request Dispatch
+ * below).
  */
 static void sh_setup_begin( void )
 {
-	unsigned char status_buf[2];  /* returned in GET_STATUS */
-	unsigned char status_buf2[4];  /* returned in GET_STATUS_HUB */	 
 	usb_dev_request_t req;
+	struct setup_handler * h;
 	int request_type;
-	u16 status;
-	u16 change;
+	int port;
 	int n;
-	__u32 address;
+	__u32 t0, dt;
 	__u32 cs_reg_in = Ser0UDCCS0;
 	
 	if (cs_reg_in & UDCCS0_SST) {
-		PRINTKD( "[%lu]setup begin: sent stall. Continuing\n", (jiffies-start_time)*10);
+		PRINTKD( "[%lu]setup begin: sent stall. Continuing\n", NOW_US());
 		set_cs_bits( UDCCS0_SST );
 	}
 
 	if ( cs_reg_in & UDCCS0_SE ) {
-		PRINTKD( "[%lu]setup begin: Early term of setup. Continuing\n", (jiffies-start_time)*10);
+		PRINTKD( "[%lu]setup begin: Early term of setup. Continuing\n", NOW_US());
 		set_cs_bits( UDCCS0_SSE );  		 /* clear setup end */
 	}
 
@@ -240,11 +515,13 @@ static void sh_setup_begin( void )
 		goto sh_sb_end;
 	}
 
-	/* read the setup request */
-	n = read_fifo( &req );
+	/* read the setup request, unless the FIQ handler already has */
+	n = udc_fiq_take_setup( &req, &ep0_int_t0 );
+	if ( !n )
+		n = read_fifo( &req );
 	if ( n != sizeof( req ) ) {
 		printk( "[%lu]%ssetup begin: fifo READ ERROR wanted %d bytes got %d. Stalling out...\n", 
-			(jiffies-start_time)*10, pszep0, sizeof( req ), n );
+			NOW_US(), pszep0, sizeof( req ), n );
 		/* force stall, serviced out */
 		set_cs_bits( UDCCS0_FST | UDCCS0_SO  );
 		goto sh_sb_end;
@@ -253,395 +530,476 @@ static void sh_setup_begin( void )
 	/* Is it a standard or class request ? (not vendor or reserved request) */
 	request_type = type_code_from_request( req.bmRequestType );
 
-	if ( request_type != 0 && request_type != 2) {
-		printk( "[%lu]setup begin: unsupported bmRequestType: %d ignored\n", (jiffies-start_time)*10, request_type );
+	if ( request_type != STANDARD_REQUEST && request_type != CLASS_REQUEST) {
+		printk( "[%lu]setup begin: unsupported bmRequestType: %d ignored\n", NOW_US(), request_type );
 		set_cs_bits( UDCCS0_DE | UDCCS0_SO );
 		goto sh_sb_end;
 	}
 
-	PRINTKI("[%lu]%s Setup called %s (%d - %d) ->  (req=%d) (%d:%d %d)\n", (jiffies-start_time)*10, 
-			STATUS_STR(machine_state),REQUEST_STR(((req.bmRequestType << 8) | req.bRequest)), 
-			req.wValue, req.wIndex, req.wLength, currentPort, Ser0UDCAR, Ser0UDCCS0);
+	port = currentPort;
+	h = setup_lookup( port, &req );
+	ep0_lat_open( port, &req );
 
-	// Device setup
-	if (currentPort) {
-		switch( req.bRequest ) {
-		case GET_DESCRIPTOR:
-			get_device_descriptor(&req);
-			break;
-		case SET_CONFIGURATION:
-			if (currentPort == 5) {
-				printk( "[%lu]SET CONFIGURATION ON JIG\n", (jiffies-start_time)*10);
-				jig_set_config();
-			}
-			set_cs_bits( UDCCS0_DE | UDCCS0_SO );
-			break;
-		case GET_CONFIGURATION:
-		case GET_STATUS:
-		case SET_INTERFACE:
-			if (currentPort == 5) {
-				printk( "[%lu]SET INTERFACE ON JIG\n", (jiffies-start_time)*10);
-			}
-			set_cs_bits( UDCCS0_DE | UDCCS0_SO );
-			break;
-		case SET_ADDRESS:
-			address = (__u32) (req.wValue & 0x7F);
-			portAddress[currentPort] = address;
-			set_cs_bits( UDCCS0_DE | UDCCS0_SO );
-			//Ser0UDCAR = address;
-			if (addr_delay) {
-				udelay(addr_delay);
-			}
-			break;
-		case GET_INTERFACE:
-			status_buf[0] = 0;
-			queue_and_start_write( status_buf, req.wLength, 1 );
-			break;
-		default:
-			set_cs_bits( UDCCS0_DE | UDCCS0_SO );
-			break;
-		}		
-/*unknown:
-		DBG(dev, "unknown control req%02x.%02x v%04x i%04x l%d\n",
-		ctrl->bRequestType, ctrl->bRequest,
-		w_value, w_index, w_length);		*/
-		goto sh_sb_end;
+	PRINTKI("[%lu]%s Setup called %s (%d - %d) ->  (req=%d) (%d:%d %d)\n", NOW_US(), 
+			STATUS_STR(machine_state), h->name, 
+			req.wValue, req.wIndex, req.wLength, port, Ser0UDCAR, Ser0UDCCS0);
+
+	t0 = OSCR;
+	(*h->fn)( &req );
+	dt = OSCR - t0;
+	h->calls++;
+	h->ticks += dt;
+	if ( dt > h->max_ticks )
+		h->max_ticks = dt;
+
+	/* Enable the timer if it's not already enabled */
+	if (port == 0 && timer_added == 0) {
+    	ost_add (&state_machine_event, 0);
+  		timer_added = 1;
 	}
 
-	switch(request_type) {
-	case STANDARD_REQUEST:
-		/* Handle it */
-		switch( req.bRequest ) {
-			/* This first bunch have no data phase */
-		case SET_ADDRESS:
-			address = (__u32) (req.wValue & 0x7F);
-			/* when SO and DE sent, UDC will enter status phase and ack,
-						..propagating new address to udc core. Next control transfer
-						..will be on the new address. You can't see the change in a
-						..read back of CAR until then. (about 250us later, on my box).
-						..The original Intel driver sets S0 and DE and code to check
-						..that address has propagated here. I tried this, but it
-						..would only work sometimes! The rest of the time it would
-						..never propagate and we'd spin forever. So now I just set
-						..it and pray...
-					*/
-			portAddress[currentPort] = address;
-			Ser0UDCAR = address;
-			set_cs_bits( UDCCS0_DE | UDCCS0_SO );
-			break;
-		case SET_CONFIGURATION:
-			if ( req.wValue == 1 ) {
-				usbd_info.state = USB_STATE_CONFIGURED;
-				hub_interrupt_queued = 0;
-				PRINTKI("[%lu]reset config\n", (jiffies-start_time)*10);
-			} else if ( req.wValue == 0 ) {
-				printk( "[%lu]%ssetup phase: Unknown "
-					"\"set configuration\" data %d\n", (jiffies-start_time)*10, pszep0, req.wValue );
-			}
-			set_cs_bits( UDCCS0_DE | UDCCS0_SO );
+sh_sb_end:
+	return;
+}
+
+/* --- Hub (port 0), standard requests ---------------------------------- */
+
+SETUP_HANDLER(sh_ack, "any", "ACK");
+static void sh_ack( usb_dev_request_t * req )
+{
+	set_cs_bits( UDCCS0_DE | UDCCS0_SO );
+}
+
+SETUP_HANDLER(sh_ignore, "any", "IGNORED");
+static void sh_ignore( usb_dev_request_t * req )
+{
+}
+
+SETUP_HANDLER(hub_set_address, "hub", "SET_ADDRESS");
+static void hub_set_address( usb_dev_request_t * req )
+{
+	__u32 address = (__u32) (req->wValue & 0x7F);
+
+	/* when SO and DE sent, UDC will enter status phase and ack,
+				..propagating new address to udc core. Next control transfer
+				..will be on the new address. You can't see the change in a
+				..read back of CAR until then. (about 250us later, on my box).
+				..The original Intel driver sets S0 and DE and code to check
+				..that address has propagated here. I tried this, but it
+				..would only work sometimes! The rest of the time it would
+				..never propagate and we'd spin forever. So now I just set
+				..it and pray...
+			*/
+	portAddress[currentPort] = address;
+	Ser0UDCAR = address;
+	set_cs_bits( UDCCS0_DE | UDCCS0_SO );
+}
+
+SETUP_HANDLER(hub_set_configuration, "hub", "SET_CONFIGURATION");
+static void hub_set_configuration( usb_dev_request_t * req )
+{
+	if ( req->wValue == 1 ) {
+		usbd_info.state = USB_STATE_CONFIGURED;
+		hub_interrupt_queued = 0;
+		hub_status_pending = 0;
+		PRINTKI("[%lu]reset config\n", NOW_US());
+	} else if ( req->wValue == 0 ) {
+		printk( "[%lu]%ssetup phase: Unknown "
+			"\"set configuration\" data %d\n", NOW_US(), pszep0, req->wValue );
+	}
+	set_cs_bits( UDCCS0_DE | UDCCS0_SO );
+}
+
+SETUP_HANDLER(hub_get_status, "hub", "GET_STATUS");
+static void hub_get_status( usb_dev_request_t * req )
+{
+	unsigned char status_buf[2];  /* returned in GET_STATUS */
+
+	/* return status bit flags */
+	status_buf[0] = status_buf[1] = 0;
+	switch( req->bmRequestType & 0x0f ) {
+	case kTargetDevice:
+		status_buf[0] |= 1;
+		break;
+	case kTargetInterface:
+	case kTargetEndpoint:
+		/* no stalled bit to return */
+		break;
+	default:
+		printk( "[%lu]%sUnknown target (%d) in GET_STATUS\n", NOW_US(), pszep0,
+			req->bmRequestType & 0x0f );
+		break;
+	}
+	queue_and_start_write(status_buf, req->wLength, sizeof(status_buf));
+}
+
+SETUP_HANDLER(hub_get_descriptor, "hub", "GET_DESCRIPTOR");
+static void hub_get_descriptor( usb_dev_request_t * req )
+{
+	get_hub_descriptor( req );
+}
+
+SETUP_HANDLER(hub_get_configuration, "hub", "GET_CONFIGURATION");
+static void hub_get_configuration( usb_dev_request_t * req )
+{
+	unsigned char status_buf[1];
+
+	status_buf[0] = (usbd_info.state ==  USB_STATE_CONFIGURED) 	? 1 : 0;
+	queue_and_start_write( status_buf, req->wLength, 1 );
+}
+
+SETUP_HANDLER(hub_get_interface, "hub", "GET_INTERFACE");
+static void hub_get_interface( usb_dev_request_t * req )
+{
+	printk( "[%lu]%sfixme: get interface not supported\n", NOW_US(), pszep0 );
+	queue_and_start_write( NULL, req->wLength, 0 );
+}
+
+SETUP_HANDLER(hub_set_interface, "hub", "SET_INTERFACE");
+static void hub_set_interface( usb_dev_request_t * req )
+{
+	printk( "[%lu]%sfixme: set interface not supported\n", NOW_US(), pszep0 );
+	set_cs_bits( UDCCS0_DE | UDCCS0_SO );
+}
+
+SETUP_HANDLER(hub_std_unknown, "hub", "UNKNOWN");
+static void hub_std_unknown( usb_dev_request_t * req )
+{
+	printk("[%lu]%sunknown request 0x%x\n", NOW_US(), pszep0, req->bRequest);
+	set_cs_bits( UDCCS0_DE | UDCCS0_SO );
+}
+
+/* --- Hub (port 0), class requests ------------------------------------- */
+
+SETUP_HANDLER(hub_class_get_descriptor, "hub", "GET_HUB_DESCRIPTOR");
+static void hub_class_get_descriptor( usb_dev_request_t * req )
+{
+	get_device_descriptor( req );
+}
+
+SETUP_HANDLER(hub_clear_port_feature, "hub", "CLEAR_PORT_FEATURE");
+static void hub_clear_port_feature( usb_dev_request_t * req )
+{
+	if (req->wIndex == 0 || req->wIndex > 6) {
+		printk( "[%lu]%s: clear feature invalid port  %02x\n", NOW_US(), pszep0, req->wIndex);					
+		set_cs_bits( UDCCS0_DE | UDCCS0_SO );					
+		return;
+	}
+	switch(req->wValue) {
+	case 0: /* PORT_CONNECTION */
+	case 1: /* PORT_ENABLE */
+	case 2: /* PORT_SUSPEND */
+	case 3: /* PORT_OVER_CURRENT */
+	case 4: /* PORT_RESET */
+	case 8: /* PORT_POWER */
+	case 9: /* PORT_LOW_SPEED */
+		set_cs_bits( UDCCS0_DE | UDCCS0_SO );
+		break;
+	case 16: // C_PORT_CONNECTION
+		PRINTKI( "[%lu]ClearPortFeature C_PORT_CONNECTION called\n", NOW_US());
+		port_change[req->wIndex-1] &= ~PORT_STAT_C_CONNECTION;					
+		switch (machine_state) {
+		case DEVICE1_WAIT_DISCONNECT:
+			machine_state = DEVICE1_DISCONNECTED;
+			SET_TIMER (200);
 			break;
-		case CLEAR_FEATURE:
-			// /* could check data length, direction...26Jan01ww */
-			// if ( req.wValue == 0 ) { /* clearing ENDPOINT_HALT/STALL */
-				// int ep = windex_to_ep_num( req.wIndex );
-				// if ( ep == 1 ) {
-					// printk( "[%lu]%sclear feature \"endpoint halt\" "
-						// " on receiver\n", (jiffies-start_time)*10, pszep0 );
-					// ep1_reset();
-				// }
-				// else if ( ep == 2 ) {
-					// printk( "[%lu]%sclear feature \"endpoint halt\" "
-						// "on xmitter\n", (jiffies-start_time)*10, pszep0 );
-					// ep2_reset();
-				// } else {
-					// printk( "[%lu]%sclear feature \"endpoint halt\" "
-						// "on unsupported ep # %d\n", (jiffies-start_time)*10,	pszep0, ep );
-				// }
-			// } else {
-				// printk( "[%lu]%sUnsupported feature selector (%d) in clear feature. Ignored.\n", 
-					// (jiffies-start_time)*10,	pszep0, req.wValue );
-			// }
-			set_cs_bits( UDCCS0_DE | UDCCS0_SO );
+		case DEVICE2_WAIT_DISCONNECT:
+			machine_state = DEVICE2_DISCONNECTED;
+			SET_TIMER (110);
 			break;
-		case SET_FEATURE:
-			// if ( req.wValue == 0 ) { /* setting ENDPOINT_HALT/STALL */
-				// int ep = windex_to_ep_num( req.wValue );
-				// if ( ep == 1 ) {
-					// printk( "[%lu]%set feature \"endpoint halt\" "
-						// "on receiver\n", (jiffies-start_time)*10, pszep0 );
-					// ep1_stall();
-				// }
-				// else if ( ep == 2 ) {
-					// printk( "[%lu]%sset feature \"endpoint halt\" "
-						// " on xmitter\n", (jiffies-start_time)*10, pszep0 );
-					// ep2_stall();
-				// } else {
-					// printk( "[%lu]%sset feature \"endpoint halt\" "
-						// "on unsupported ep # %d\n", (jiffies-start_time)*10,	pszep0, ep );
-				// }
-			// }
-			// else {
-				// printk( "[%lu]%sUnsupported feature selector (%d) in set feature\n", 
-						// (jiffies-start_time)*10, pszep0, req.wValue );
-				// set_cs_bits( UDCCS0_SST );
-				// goto sh_sb_end;
-			// }
-			set_cs_bits( UDCCS0_DE | UDCCS0_SO );
+		case DEVICE3_WAIT_DISCONNECT:
+			machine_state = DEVICE3_DISCONNECTED;
+			SET_TIMER (450);
 			break;
-		case GET_STATUS:
-			/* return status bit flags */
-			status_buf[0] = status_buf[1] = 0;
-			switch( req.bmRequestType & 0x0f ) {
-			case kTargetDevice:
-				status_buf[0] |= 1;
-				break;
-			case kTargetInterface:
-				break;
-			case kTargetEndpoint:
-				/* return stalled bit */
-				// n = windex_to_ep_num( req.wIndex );
-				// if ( n == 1 )
-					// status_buf[0] |= (Ser0UDCCS1 & UDCCS1_FST) >> 4;
-				// else if ( n == 2 )
-					// status_buf[0] |= (Ser0UDCCS2 & UDCCS2_FST) >> 5;
-				// else {
-					// printk( "[%lu]%sUnknown endpoint (%d) "
-						// "in GET_STATUS\n", (jiffies-start_time)*10, pszep0, n );
-				// }
-				break;
-			default:
-				printk( "[%lu]%sUnknown target (%d) in GET_STATUS\n", (jiffies-start_time)*10, pszep0, n );
-				/* fall thru */
-				break;
-			}
-			queue_and_start_write(status_buf, req.wLength, sizeof(status_buf));
+		case DEVICE4_WAIT_DISCONNECT:
+			machine_state = DEVICE4_DISCONNECTED;
+			SET_TIMER (200);
 			break;
-		case GET_DESCRIPTOR:
-			get_hub_descriptor( &req );
+		case DEVICE5_WAIT_DISCONNECT:
+			machine_state = DEVICE5_DISCONNECTED;
+			SET_TIMER (200);
 			break;
-		case GET_CONFIGURATION:
-			status_buf[0] = (usbd_info.state ==  USB_STATE_CONFIGURED) 	? 1 : 0;
-			queue_and_start_write( status_buf, req.wLength, 1 );			
+		default:
 			break;
-		case GET_INTERFACE:
-			printk( "[%lu]%sfixme: get interface not supported\n", (jiffies-start_time)*10, pszep0 );
-			queue_and_start_write( NULL, req.wLength, 0 );
+		}
+		set_cs_bits( UDCCS0_DE | UDCCS0_SO );
+		break;
+	case 20: // C_PORT_RESET
+		PRINTKI( "[%lu]ClearPortFeature C_PORT_RESET called\n", NOW_US());
+		port_change[req->wIndex-1] &= ~PORT_STAT_C_RESET;
+		switch (machine_state) {
+		case DEVICE1_WAIT_READY:
+			if (req->wIndex == 1)
+				switch_to_port_delayed = req->wIndex;
 			break;
-		case SET_INTERFACE:
-			printk( "[%lu]%sfixme: set interface not supported\n", (jiffies-start_time)*10, pszep0 );
-			set_cs_bits( UDCCS0_DE | UDCCS0_SO );
+		case DEVICE2_WAIT_READY:
+			if (req->wIndex == 2)
+				switch_to_port_delayed = req->wIndex;
 			break;
-		default :
-			printk("[%lu]%sunknown request 0x%x\n", (jiffies-start_time)*10, pszep0, req.bRequest);
-			set_cs_bits( UDCCS0_DE | UDCCS0_SO );
+		case DEVICE3_WAIT_READY:
+			if (req->wIndex == 3)
+				switch_to_port_delayed = req->wIndex;
 			break;
-		} /* switch( bRequest ) */
-		break;
-	case CLASS_REQUEST:
-		/* Handle it */
-		switch( req.bRequest ) {
-		case GET_DESCRIPTOR:
-			get_device_descriptor(&req);
+		case DEVICE4_WAIT_READY:
+			if (req->wIndex == 4)
+				switch_to_port_delayed = req->wIndex;
 			break;
-		case CLEAR_FEATURE: // 0x01
-			switch (req.bmRequestType & 0x1f) {
-			case 0: //USB_RECIP_DEVICE
-				set_cs_bits( UDCCS0_DE | UDCCS0_SO );
-				break;
-			case 3: //USB_RECIP_OTHER
-				if (req.wIndex == 0 || req.wIndex > 6) {
-					printk( "[%lu]%s: clear feature invalid port  %02x\n", (jiffies-start_time)*10, pszep0, req.wIndex);					
-					set_cs_bits( UDCCS0_DE | UDCCS0_SO );					
-					break;
-				}
-				switch(req.wValue) {
-				case 0: /* PORT_CONNECTION */
-				case 1: /* PORT_ENABLE */
-				case 2: /* PORT_SUSPEND */
-				case 3: /* PORT_OVER_CURRENT */
-				case 4: /* PORT_RESET */
-				case 8: /* PORT_POWER */
-				case 9: /* PORT_LOW_SPEED */
-					set_cs_bits( UDCCS0_DE | UDCCS0_SO );
-					break;
-				case 16: // C_PORT_CONNECTION
-					PRINTKI( "[%lu]ClearPortFeature C_PORT_CONNECTION called\n", (jiffies-start_time)*10);
-					port_change[req.wIndex-1] &= ~PORT_STAT_C_CONNECTION;					
-					switch (machine_state) {
-					case DEVICE1_WAIT_DISCONNECT:
-						machine_state = DEVICE1_DISCONNECTED;
-						SET_TIMER (200);
-						break;
-					case DEVICE2_WAIT_DISCONNECT:
-						machine_state = DEVICE2_DISCONNECTED;
-						SET_TIMER (110);
-						break;
-					case DEVICE3_WAIT_DISCONNECT:
-						machine_state = DEVICE3_DISCONNECTED;
-						SET_TIMER (450);
-						break;
-					case DEVICE4_WAIT_DISCONNECT:
-						machine_state = DEVICE4_DISCONNECTED;
-						SET_TIMER (200);
-						break;
-					case DEVICE5_WAIT_DISCONNECT:
-						machine_state = DEVICE5_DISCONNECTED;
-						SET_TIMER (200);
-						break;
-					default:
-						break;
-					}
-					set_cs_bits( UDCCS0_DE | UDCCS0_SO );
-					break;
-				case 20: // C_PORT_RESET
-					PRINTKI( "[%lu]ClearPortFeature C_PORT_RESET called\n", (jiffies-start_time)*10);
-					port_change[req.wIndex-1] &= ~PORT_STAT_C_RESET;
-					switch (machine_state) {
-					case DEVICE1_WAIT_READY:
-						if (req.wIndex == 1)
-							switch_to_port_delayed = req.wIndex;
-						break;
-					case DEVICE2_WAIT_READY:
-						if (req.wIndex == 2)
-							switch_to_port_delayed = req.wIndex;
-						break;
-					case DEVICE3_WAIT_READY:
-						if (req.wIndex == 3)
-							switch_to_port_delayed = req.wIndex;
-						break;
-					case DEVICE4_WAIT_READY:
-						if (req.wIndex == 4)
-							switch_to_port_delayed = req.wIndex;
-						break;
-					case DEVICE5_WAIT_READY:
-						if (req.wIndex == 5)
-							switch_to_port_delayed = req.wIndex;
-						break;
-					default:
-						break;
-					}
-					/* Delay switching the port because we first need to response
-									to this request with the proper address */
-					set_cs_bits( UDCCS0_DE | UDCCS0_SO );
-					// if (switch_to_port_delayed >= 0) {
-						// SET_TIMER (0);
-					// }
-					break;
-				}					
-				break;
-			}
+		case DEVICE5_WAIT_READY:
+			if (req->wIndex == 5)
+				switch_to_port_delayed = req->wIndex;
 			break;
-		case GET_STATUS:
-			switch (req.bmRequestType & 0x1f) {			
-			case 0: //USB_RECIP_DEVICE
-				status = 0;
-				change = 0;
-				break;
-			case 3: //USB_RECIP_OTHER
-			    status = port_status[req.wIndex - 1];
-				change = port_change[req.wIndex - 1];
-				// Stop requesting device5 status at DEVICE5_WAIT_READY
-				// Stop requesting device3 status at DEVICE3_WAIT_DISCONNECT
-				if (device_retry == req.wIndex) {
-					PRINTKI( "[%lu]GetHub/PortStatus: stop port %d \n", (jiffies-start_time)*10, device_retry);
-					switch (machine_state) {
-						case DEVICE4_READY:
-							device_retry = -1;
-							machine_state = DEVICE5_WAIT_READY;
-							break;
-						case DEVICE5_READY:
-							device_retry = -1;
-							machine_state = DEVICE3_WAIT_DISCONNECT;
-							break;					
-						default:
-							break;
-					}
-				}
-				break;
-			}
-			
-			status = cpu_to_le16 (status);
-			change = cpu_to_le16 (change);
-			PRINTKI( "[%lu]GetHub/PortStatus: transmiting status %d change %d\n", (jiffies-start_time)*10, status+1024, change);			
-			memcpy(status_buf2, &status, sizeof(u16));
-			memcpy(status_buf2 + sizeof(u16), &change, sizeof(u16));
-			queue_and_start_write( status_buf2, req.wLength,	sizeof( status_buf2) );
+		default:
 			break;
-		case SET_FEATURE: // 0x03
-			switch (req.bmRequestType & 0x1f) {
-				/* SET_HUB_FEATURE */
-			case 0: //USB_RECIP_DEVICE
-				switch (req.wValue) {
-				case 0: /* C_HUB_LOCAL_POWER */
-				case 1: /* C_HUB_OVER_CURRENT */
-					set_cs_bits( UDCCS0_DE | UDCCS0_SO );
-					break;
-				default:
-					printk( "[%lu]%s: set hub feature %02x not supported\n", (jiffies-start_time)*10, pszep0, req.wValue);
-					set_cs_bits( UDCCS0_DE | UDCCS0_SO );					
-					break;
-				} //switch (req.wValue)
+		}
+		/* Delay switching the port because we first need to response
+						to this request with the proper address */
+		set_cs_bits( UDCCS0_DE | UDCCS0_SO );
+		break;
+	}
+}
+
+static void hub_send_status( usb_dev_request_t * req, u16 status, u16 change )
+{
+	unsigned char status_buf2[4];  /* returned in GET_STATUS_HUB */
+
+	status = cpu_to_le16 (status);
+	change = cpu_to_le16 (change);
+	PRINTKI( "[%lu]GetHub/PortStatus: transmiting status %d change %d\n", NOW_US(), status+1024, change);			
+	memcpy(status_buf2, &status, sizeof(u16));
+	memcpy(status_buf2 + sizeof(u16), &change, sizeof(u16));
+	queue_and_start_write( status_buf2, req->wLength,	sizeof( status_buf2) );
+}
+
+SETUP_HANDLER(hub_get_hub_status, "hub", "GET_HUB_STATUS");
+static void hub_get_hub_status( usb_dev_request_t * req )
+{
+	hub_send_status( req, 0, 0 );
+}
+
+SETUP_HANDLER(hub_get_port_status, "hub", "GET_PORT_STATUS");
+static void hub_get_port_status( usb_dev_request_t * req )
+{
+	u16 status = port_status[req->wIndex - 1];
+	u16 change = port_change[req->wIndex - 1];
+
+	// Stop requesting device5 status at DEVICE5_WAIT_READY
+	// Stop requesting device3 status at DEVICE3_WAIT_DISCONNECT
+	if (device_retry == req->wIndex) {
+		PRINTKI( "[%lu]GetHub/PortStatus: stop port %d \n", NOW_US(), device_retry);
+		switch (machine_state) {
+			case DEVICE4_READY:
+				device_retry = -1;
+				machine_state = DEVICE5_WAIT_READY;
 				break;
-			case 3: //USB_RECIP_OTHER
-				/* SET_PORT_FEATURE */
-				if (req.wIndex == 0 || req.wIndex > 6) {					
-					printk( "[%lu]%s: invalid port  %02x\n", (jiffies-start_time)*10, pszep0, req.wIndex);
-					set_cs_bits( UDCCS0_DE | UDCCS0_SO );
-					break;
-				}
-				switch (req.wValue) {
-				case 4: /* PORT_RESET */
-					PRINTKI( "[%lu]SetPortFeature PORT_RESET called (%d %d)\n", (jiffies-start_time)*10, expected_port_reset, req.wIndex);
-					// There seem to be port resets to other port
-					if (expected_port_reset == req.wIndex) {
-						port_change[req.wIndex-1] |= PORT_STAT_C_RESET;
-						last_port_reset = req.wIndex;
-					}
-					set_cs_bits( UDCCS0_DE | UDCCS0_SO );
-					break;
-				case 8: /* PORT_POWER */
-					PRINTKI( "[%lu]SetPortFeature PORT_POWER called\n", (jiffies-start_time)*10);
-					port_status[req.wIndex-1] |= PORT_STAT_POWER;
-					if (machine_state == INIT && req.wIndex == 6) {
-						machine_state = HUB_READY;
-						SET_TIMER (15);
-					}					
-					set_cs_bits( UDCCS0_DE | UDCCS0_SO );
-					break;
-				case 0: /* PORT_CONNECTION */
-				case 1: /* PORT_ENABLE */
-				case 2: /* PORT_SUSPEND */
-				case 3: /* PORT_OVER_CURRENT */
-				case 9: /* PORT_LOW_SPEED */
-				case 16: /* C_PORT_CONNECTION */
-				case 17: /* C_PORT_ENABLE */
-				case 18: /* C_PORT_SUSPEND */
-				case 19: /* C_PORT_OVER_CURRENT */
-				case 20: /* C_PORT_RESET */
-				case 21: /* PORT_TEST */
-				case 22: /* PORT_INDICATOR */
-					set_cs_bits( UDCCS0_DE | UDCCS0_SO );
-					break;
-				default:
-					printk( "[%lu]%s: set port feature %02x not supported\n", (jiffies-start_time)*10, pszep0, req.wValue);
-					set_cs_bits( UDCCS0_DE | UDCCS0_SO );					
-					break;
-				} // (req.wValue)
+			case DEVICE5_READY:
+				device_retry = -1;
+				machine_state = DEVICE3_WAIT_DISCONNECT;
+				break;					
+			default:
 				break;
-			} //(req.bmRequestType & 0x1f)
-			break;
-		} //( req.bRequest )
+		}
+	}
+	hub_send_status( req, status, change );
+}
+
+SETUP_HANDLER(hub_set_hub_feature, "hub", "SET_HUB_FEATURE");
+static void hub_set_hub_feature( usb_dev_request_t * req )
+{
+	switch (req->wValue) {
+	case 0: /* C_HUB_LOCAL_POWER */
+	case 1: /* C_HUB_OVER_CURRENT */
+		set_cs_bits( UDCCS0_DE | UDCCS0_SO );
+		break;
+	default:
+		printk( "[%lu]%s: set hub feature %02x not supported\n", NOW_US(), pszep0, req->wValue);
+		set_cs_bits( UDCCS0_DE | UDCCS0_SO );					
 		break;
-	} //(request_type)
-	
-	/* Enable the timer if it's not already enabled */
-	if (timer_added == 0) {
-    	add_timer (&state_machine_timer);
-  		timer_added = 1;
 	}
+}
 
-sh_sb_end:
-	return;
+SETUP_HANDLER(hub_set_port_feature, "hub", "SET_PORT_FEATURE");
+static void hub_set_port_feature( usb_dev_request_t * req )
+{
+	if (req->wIndex == 0 || req->wIndex > 6) {					
+		printk( "[%lu]%s: invalid port  %02x\n", NOW_US(), pszep0, req->wIndex);
+		set_cs_bits( UDCCS0_DE | UDCCS0_SO );
+		return;
+	}
+	switch (req->wValue) {
+	case 4: /* PORT_RESET */
+		PRINTKI( "[%lu]SetPortFeature PORT_RESET called (%d %d)\n", NOW_US(), expected_port_reset, req->wIndex);
+		// There seem to be port resets to other port
+		if (expected_port_reset == req->wIndex) {
+			port_change[req->wIndex-1] |= PORT_STAT_C_RESET;
+			last_port_reset = req->wIndex;
+		}
+		set_cs_bits( UDCCS0_DE | UDCCS0_SO );
+		break;
+	case 8: /* PORT_POWER */
+		PRINTKI( "[%lu]SetPortFeature PORT_POWER called\n", NOW_US());
+		port_status[req->wIndex-1] |= PORT_STAT_POWER;
+		if (machine_state == INIT && req->wIndex == 6) {
+			machine_state = HUB_READY;
+			SET_TIMER (15);
+		}					
+		set_cs_bits( UDCCS0_DE | UDCCS0_SO );
+		break;
+	case 0: /* PORT_CONNECTION */
+	case 1: /* PORT_ENABLE */
+	case 2: /* PORT_SUSPEND */
+	case 3: /* PORT_OVER_CURRENT */
+	case 9: /* PORT_LOW_SPEED */
+	case 16: /* C_PORT_CONNECTION */
+	case 17: /* C_PORT_ENABLE */
+	case 18: /* C_PORT_SUSPEND */
+	case 19: /* C_PORT_OVER_CURRENT */
+	case 20: /* C_PORT_RESET */
+	case 21: /* PORT_TEST */
+	case 22: /* PORT_INDICATOR */
+		set_cs_bits( UDCCS0_DE | UDCCS0_SO );
+		break;
+	default:
+		printk( "[%lu]%s: set port feature %02x not supported\n", NOW_US(), pszep0, req->wValue);
+		set_cs_bits( UDCCS0_DE | UDCCS0_SO );					
+		break;
+	}
+}
+
+/* --- Emulated devices (ports 1-5) ------------------------------------- */
+
+SETUP_HANDLER(dev_get_descriptor, "dev", "GET_DESCRIPTOR");
+static void dev_get_descriptor( usb_dev_request_t * req )
+{
+	get_device_descriptor( req );
+}
+
+SETUP_HANDLER(dev_set_address, "dev", "SET_ADDRESS");
+static void dev_set_address( usb_dev_request_t * req )
+{
+	portAddress[currentPort] = (__u32) (req->wValue & 0x7F);
+	set_cs_bits( UDCCS0_DE | UDCCS0_SO );
+	//Ser0UDCAR = address;
+	if (addr_delay) {
+		udelay(addr_delay);
+	}
+}
+
+SETUP_HANDLER(dev_get_interface, "dev", "GET_INTERFACE");
+static void dev_get_interface( usb_dev_request_t * req )
+{
+	unsigned char status_buf[1];
+
+	status_buf[0] = 0;
+	queue_and_start_write( status_buf, req->wLength, 1 );
+}
+
+SETUP_HANDLER(jig_setup_set_configuration, "jig", "SET_CONFIGURATION");
+static void jig_setup_set_configuration( usb_dev_request_t * req )
+{
+	printk( "[%lu]SET CONFIGURATION ON JIG\n", NOW_US());
+	jig_set_config();
+	set_cs_bits( UDCCS0_DE | UDCCS0_SO );
+}
+
+SETUP_HANDLER(jig_setup_set_interface, "jig", "SET_INTERFACE");
+static void jig_setup_set_interface( usb_dev_request_t * req )
+{
+	printk( "[%lu]SET INTERFACE ON JIG\n", NOW_US());
+	set_cs_bits( UDCCS0_DE | UDCCS0_SO );
+}
+
+static struct setup_handler * setup_handlers[] = {
+	&setup_sh_ack, &setup_sh_ignore,
+	&setup_hub_set_address, &setup_hub_set_configuration, &setup_hub_get_status,
+	&setup_hub_get_descriptor, &setup_hub_get_configuration, &setup_hub_get_interface,
+	&setup_hub_set_interface, &setup_hub_std_unknown,
+	&setup_hub_class_get_descriptor, &setup_hub_clear_port_feature, &setup_hub_get_hub_status,
+	&setup_hub_get_port_status, &setup_hub_set_hub_feature, &setup_hub_set_port_feature,
+	&setup_dev_get_descriptor, &setup_dev_set_address, &setup_dev_get_interface,
+	&setup_jig_setup_set_configuration, &setup_jig_setup_set_interface,
+};
+
+/* Install h for (type, recipient, bRequest); recip < 0 means any recipient */
+static void setup_set( int port, int type, int recip, int request, struct setup_handler * h )
+{
+	int r;
+
+	for (r = 0; r <= 3; r++) {
+		if (recip >= 0 && r != recip)
+			continue;
+		setup_vec[port][SETUP_KEY( (type << 4) | r, request )] = h;
+	}
+}
+
+/* Emulated devices answer by bRequest alone, whatever the type */
+static void setup_set_dev( int port, int request, struct setup_handler * h )
+{
+	setup_set( port, STANDARD_REQUEST, -1, request, h );
+	setup_set( port, CLASS_REQUEST, -1, request, h );
+}
+
+void ep0_setup_init( void )
+{
+	int port;
+	int r;
+
+	memset(setup_vec, 0, sizeof(setup_vec));
+
+	/* port 0: the hub itself */
+	setup_default[0][STANDARD_REQUEST] = &setup_hub_std_unknown;
+	setup_default[0][CLASS_REQUEST] = &setup_sh_ignore;
+	for (r = 0; r <= 0x0f; r++) {
+		setup_set( 0, STANDARD_REQUEST, -1, r, &setup_hub_std_unknown );
+		setup_set( 0, CLASS_REQUEST, -1, r, &setup_sh_ignore );
+	}
+	setup_set( 0, STANDARD_REQUEST, -1, SET_ADDRESS, &setup_hub_set_address );
+	setup_set( 0, STANDARD_REQUEST, -1, SET_CONFIGURATION, &setup_hub_set_configuration );
+	setup_set( 0, STANDARD_REQUEST, -1, CLEAR_FEATURE, &setup_sh_ack );
+	setup_set( 0, STANDARD_REQUEST, -1, SET_FEATURE, &setup_sh_ack );
+	setup_set( 0, STANDARD_REQUEST, -1, GET_STATUS, &setup_hub_get_status );
+	setup_set( 0, STANDARD_REQUEST, -1, GET_DESCRIPTOR, &setup_hub_get_descriptor );
+	setup_set( 0, STANDARD_REQUEST, -1, GET_CONFIGURATION, &setup_hub_get_configuration );
+	setup_set( 0, STANDARD_REQUEST, -1, GET_INTERFACE, &setup_hub_get_interface );
+	setup_set( 0, STANDARD_REQUEST, -1, SET_INTERFACE, &setup_hub_set_interface );
+
+	setup_set( 0, CLASS_REQUEST, -1, GET_DESCRIPTOR, &setup_hub_class_get_descriptor );
+	setup_set( 0, CLASS_REQUEST, kRecipDevice, CLEAR_FEATURE, &setup_sh_ack );
+	setup_set( 0, CLASS_REQUEST, kRecipOther, CLEAR_FEATURE, &setup_hub_clear_port_feature );
+	setup_set( 0, CLASS_REQUEST, -1, GET_STATUS, &setup_hub_get_hub_status );
+	setup_set( 0, CLASS_REQUEST, kRecipOther, GET_STATUS, &setup_hub_get_port_status );
+	setup_set( 0, CLASS_REQUEST, kRecipDevice, SET_FEATURE, &setup_hub_set_hub_feature );
+	setup_set( 0, CLASS_REQUEST, kRecipOther, SET_FEATURE, &setup_hub_set_port_feature );
+
+	/* ports 1-6: the devices we plug in */
+	for (port = 1; port < SETUP_PORTS; port++) {
+		setup_default[port][STANDARD_REQUEST] = &setup_sh_ack;
+		setup_default[port][CLASS_REQUEST] = &setup_sh_ack;
+		for (r = 0; r <= 0x0f; r++)
+			setup_set_dev( port, r, &setup_sh_ack );
+		setup_set_dev( port, GET_DESCRIPTOR, &setup_dev_get_descriptor );
+		setup_set_dev( port, SET_ADDRESS, &setup_dev_set_address );
+		setup_set_dev( port, GET_INTERFACE, &setup_dev_get_interface );
+	}
+
+	/* port 5: the jig */
+	setup_set_dev( 5, SET_CONFIGURATION, &setup_jig_setup_set_configuration );
+	setup_set_dev( 5, GET_CONFIGURATION, &setup_jig_setup_set_interface );
+	setup_set_dev( 5, GET_STATUS, &setup_jig_setup_set_interface );
+	setup_set_dev( 5, SET_INTERFACE, &setup_jig_setup_set_interface );
+}
+
+void ep0_print_stats( void )
+{
+	struct setup_handler * h;
+	int i;
+
+	for (i = 0; i < sizeof(setup_handlers) / sizeof(setup_handlers[0]); i++) {
+		h = setup_handlers[i];
+		if (!h->calls)
+			continue;
+		printk("%s%s %s: %lu calls, avg %lu max %lu us\n", pszep0, h->who, h->name,
+			h->calls, ost_ticks_to_us(h->ticks / h->calls), ost_ticks_to_us(h->max_ticks));
+	}
 }
 
 static void sa1100_set_address(__u32 address)
@@ -675,7 +1033,7 @@ static void common_write_preamble( void )
 	 __u32 cs_reg_in = Ser0UDCCS0;
 
 	 if ( cs_reg_in & UDCCS0_SE ) {
-		  PRINTKD( "[%lu]write_preamble(): Early termination of setup\n", (jiffies-start_time)*10);
+		  PRINTKD( "[%lu]write_preamble(): Early termination of setup\n", NOW_US());
  		  wr.bytes_left=0;
 		  wr.p = NULL;
  		  Ser0UDCCS0 =  UDCCS0_SSE;  		 /* clear setup end */
@@ -683,7 +1041,7 @@ static void common_write_preamble( void )
 	 }
 
 	 if ( cs_reg_in & UDCCS0_SST ) {
-		  printk( "[%lu]write_preamble(): UDC sent stall\n", (jiffies-start_time)*10);
+		  printk( "[%lu]write_preamble(): UDC sent stall\n", NOW_US());
  		  wr.bytes_left=0;
 		  wr.p = NULL;
  		  Ser0UDCCS0 = UDCCS0_SST;  		 /* clear setup end */
@@ -692,7 +1050,7 @@ static void common_write_preamble( void )
 
 	 if ( cs_reg_in & UDCCS0_OPR ) {
 		PRINTKD( "[%lu]write_preamble(): see OPR. Stopping write to handle new SETUP\n", 
-					(jiffies-start_time)*10);
+					NOW_US());
 		wr.bytes_left=0;
 		wr.p = NULL;
  
@@ -713,10 +1071,10 @@ static void common_write_preamble( void )
  */
 static void sh_write()
 {
-	 //PRINTKD( "[%lu]W\n", (jiffies-start_time)*10);
+	 //PRINTKD( "[%lu]W\n", NOW_US());
 	 
 	 if ( Ser0UDCCS0 & UDCCS0_IPR ) {
-		  PRINTKD( "[%lu]sh_write(): IPR set, exiting %d\n", (jiffies-start_time)*10, Ser0UDCCS0);
+		  PRINTKD( "[%lu]sh_write(): IPR set, exiting %d\n", NOW_US(), Ser0UDCCS0);
 		  return;
 	 }
 
@@ -726,7 +1084,7 @@ static void sh_write()
 		..so just set DE and we are done */
 
 	 if ( 0 == wr.bytes_left ) {
-		PRINTKD( "[%lu]sh_write set DE\n", (jiffies-start_time)*10);
+		PRINTKD( "[%lu]sh_write set DE\n", NOW_US());
 		wr.p = NULL;  				/* be anal */
 		current_handler = sh_setup_begin;
 		/* that's it, so data end  */
@@ -740,7 +1098,7 @@ static void sh_write()
 	//udelay(300);
 	
 	// if ( Ser0UDCCS0 & UDCCS0_IPR ) {
-		// PRINTKI("[%lu]IPR write %d\n", (jiffies-start_time)*10, Ser0UDCCS0);
+		// PRINTKI("[%lu]IPR write %d\n", NOW_US(), Ser0UDCCS0);
 	// }	
 }
 /*
@@ -753,10 +1111,10 @@ static void sh_write()
  */
 static void sh_write_with_empty_packet( void )
 {
-	//PRINTKD( "[%lu]WE\n", (jiffies-start_time)*10);
+	//PRINTKD( "[%lu]WE\n", NOW_US());
 
 	if ( Ser0UDCCS0 & UDCCS0_IPR ) {
-		PRINTKI( "[%lu]sh_write_empty(): IPR set, exiting %d\n", (jiffies-start_time)*10, Ser0UDCCS0);
+		PRINTKI( "[%lu]sh_write_empty(): IPR set, exiting %d\n", NOW_US(), Ser0UDCCS0);
 		return;
 	}
 
@@ -767,16 +1125,24 @@ static void sh_write_with_empty_packet( void )
 	if ( 0 == wr.bytes_left ) {
 		wr.p = NULL;
 		current_handler = sh_setup_begin;
-		PRINTKD( "[%lu]sh_write empty() Sent empty packet \n", (jiffies-start_time)*10);
+		PRINTKD( "[%lu]sh_write empty() Sent empty packet \n", NOW_US());
 		set_ipr_and_de();
-		
+
+		if ( ep0_zlp_mode == EP0_ZLP_POLL ) {
+			/* Ojo funciona en Ubuntu: give the host up to 100us to
+			   take the empty packet, but no longer than it needs */
+			int i = 100;
+			while ( (Ser0UDCCS0 & UDCCS0_IPR) && i-- )
+				udelay( 1 );
+		}
 	}
 	else {
 		write_fifo();				/* send data */
 		set_ipr();				/* flag a packet is ready */
 	}
 
-	udelay(100); // Ojo funciona en Ubuntu	
+	if ( ep0_zlp_mode == EP0_ZLP_DELAY )
+		udelay(100); // Ojo funciona en Ubuntu	
 	
 	//Ser0UDCCS0 = 0;
 }
@@ -795,23 +1161,23 @@ Other Private Subroutines
  * If can't send all the data, set appropriate handler for next interrupt.
  *
  */
-static void  queue_and_start_write( void * in, int req, int act )
+static void  queue_and_start_write( const void * in, int req, int act )
 {
 	__u32 cs_reg_bits = UDCCS0_IPR;
-	unsigned char * p = (unsigned char*) in;
+	const unsigned char * p = (const unsigned char*) in;
 
-	PRINTKD( "[%lu]Qr=%d a=%d %d\n", (jiffies-start_time)*10, req, act, Ser0UDCCS0);
+	PRINTKD( "[%lu]Qr=%d a=%d %d\n", NOW_US(), req, act, Ser0UDCCS0);
 
 	/* thou shalt not enter data phase until the serviced OUT is clear */
 	if ( ! clear_opr() ) {
-		printk( "[%lu]%sSO did not clear OPR\n", (jiffies-start_time)*10, pszep0 );
+		printk( "[%lu]%sSO did not clear OPR\n", NOW_US(), pszep0 );
 		set_cs_bits ( UDCCS0_DE | UDCCS0_SO );
 		return ;
 	}
 	
 	// OJO BORRAR
 	if (0 != wr.bytes_left) {
-		printk( "[%lu]Chungo1? fifo already contains %d bytes\n", (jiffies-start_time)*10, wr.bytes_left);
+		printk( "[%lu]Chungo1? fifo already contains %d bytes\n", NOW_US(), wr.bytes_left);
 	}	 
 	
 	wr.p = p;
@@ -825,6 +1191,8 @@ static void  queue_and_start_write( void * in, int req, int act )
 	}	
 	else if ( act < req ) {   /* we are going to short-change host */
 		current_handler = sh_write_with_empty_packet; /* so need nul to not stall */
+		if ( ep0_zlp_bench )
+			ep0_zlp_t0 = OSCR;
 	}
 	else { /* we have as much or more than requested */
 		current_handler = sh_write;
@@ -833,8 +1201,8 @@ static void  queue_and_start_write( void * in, int req, int act )
 	set_cs_bits( cs_reg_bits ); /* note: IPR was set uncondtionally at start of routine */
 }
 /*
- * write_fifo()
- * Stick bytes in the 8 bytes endpoint zero FIFO.
+ * write_fifo_bytewise()
+ * Stick bytes in the 8 bytes endpoint zero FIFO, one at a time.
  * This version uses a variety of tricks to make sure the bytes
  * are written correctly. 1. The count register is checked to
  * see if the byte went in, and the write is attempted again
@@ -843,23 +1211,21 @@ static void  queue_and_start_write( void * in, int req, int act )
  * direction of the FIFO underneath us without notification
  * (in response to host aborting a setup transaction early).
  *
+ * bytes_written is what is already in the FIFO for this packet.
+ * Returns the new FIFO fill, or -1 if the setup was terminated early.
  */
-static void write_fifo( void )
+static int write_fifo_bytewise( int bytes_written, int bytes_this_time )
 {
-	int bytes_this_time = MIN( wr.bytes_left, 8 );
-	int bytes_written = 0;
-	int i=0;	
-	
-	PRINTKD( "[%lu]WF=%d: ", (jiffies-start_time)*10, bytes_this_time);
+	int i=0;
 
-	while( bytes_this_time-- ) {
+	while( bytes_written < bytes_this_time ) {
 		 PRINTKD( "%2.2X ", *wr.p );
 		 i = 0;
 		 do {
 			// Early termination (SETUP END) stop sending
 			if (Ser0UDCCS0 & UDCCS0_SE) {
-				PRINTKD( "[%lu]write_fifo(): Early termination of setup\n", (jiffies-start_time)*10);
-				return;
+				PRINTKD( "[%lu]write_fifo(): Early termination of setup\n", NOW_US());
+				return -1;
 			}
 				
 			Ser0UDCD0 = *wr.p;
@@ -867,17 +1233,88 @@ static void write_fifo( void )
 			i++;
 		 } while( Ser0UDCWC == bytes_written && i < 10 );
 		 if ( i == 10 ) {
-			printk( "[%lu]Write_fifo: write failure byte %d. CCR %d CSR %d CS0 %d\n", (jiffies-start_time)*10, bytes_written+1,
+			printk( "[%lu]Write_fifo: write failure byte %d. CCR %d CSR %d CS0 %d\n", NOW_US(), bytes_written+1,
 				Ser0UDCCR, Ser0UDCSR, Ser0UDCCS0);
+			usbd_info.stats.ep0_fifo_write_failures++;
 			hub_interrupt_queued = 0;
 		 }
 
 		 wr.p++;
 		 bytes_written++;
 	}
+	return bytes_written;
+}
+
+/*
+ * write_fifo_burst()
+ * Fill the FIFO back to back and check the count register only once.
+ * If the count doesn't match, assume what made it in is a prefix of
+ * the packet and let the bytewise writer above finish the job.
+ */
+static int write_fifo_burst( int bytes_this_time )
+{
+	int n;
+	int fifo_count;
+
+	if (Ser0UDCCS0 & UDCCS0_SE) {
+		PRINTKD( "[%lu]write_fifo(): Early termination of setup\n", NOW_US());
+		return -1;
+	}
+
+	for ( n = 0; n < bytes_this_time; n++ )
+		Ser0UDCD0 = wr.p[n];
+
+	fifo_count = Ser0UDCWC & 0xFF;
+	if ( fifo_count == bytes_this_time ) {
+		wr.p += bytes_this_time;
+		return bytes_this_time;
+	}
+
+	PRINTKD( "[%lu]write_fifo(): burst wrote %d, WCR=%d. Retrying bytewise\n", NOW_US(),
+		bytes_this_time, fifo_count);
+	usbd_info.stats.ep0_burst_fallbacks++;
+	if ( fifo_count > bytes_this_time )
+		fifo_count = bytes_this_time;
+	wr.p += fifo_count;
+	return write_fifo_bytewise( fifo_count, bytes_this_time );
+}
+
+/*
+ * write_fifo()
+ * Stick the next packet (up to 8 bytes) in the endpoint zero FIFO,
+ * either in one burst or bytewise depending on the ep0_burst
+ * module parameter. The time spent is accounted per mode in
+ * usbd_info.stats so both writers can be compared on the same
+ * enumeration sequence.
+ */
+static void write_fifo( void )
+{
+	int bytes_this_time = MIN( wr.bytes_left, 8 );
+	int mode = ep0_burst ? EP0_WR_BURST : EP0_WR_BYTEWISE;
+	int bytes_written;
+	__u32 t0 = OSCR;
+	__u32 dt;
+
+	PRINTKD( "[%lu]WF=%d: ", NOW_US(), bytes_this_time);
+
+	if ( mode == EP0_WR_BURST )
+		bytes_written = write_fifo_burst( bytes_this_time );
+	else
+		bytes_written = write_fifo_bytewise( 0, bytes_this_time );
+
+	if ( bytes_written < 0 )
+		return;
+
+	dt = OSCR - t0;
+	usbd_info.stats.ep0_wr_packets[mode]++;
+	usbd_info.stats.ep0_wr_ticks[mode] += dt;
+	if ( dt > usbd_info.stats.ep0_wr_max_ticks[mode] )
+		usbd_info.stats.ep0_wr_max_ticks[mode] = dt;
+	usbd_info.stats.ep0_bytes_written += bytes_written;
+
 	wr.bytes_left -= bytes_written;
 
-	PRINTKD( "L=%d WCR=%d\n", wr.bytes_left, Ser0UDCWC);
+	PRINTKD( "L=%d WCR=%d t=%u\n", wr.bytes_left, Ser0UDCWC, dt);
 }
 /*
  * read_fifo()
@@ -885,8 +1322,11 @@ static void write_fifo( void )
  * Called to do the initial read of setup requests
  * from the host. Return number of bytes read.
  *
- * Like write fifo above, this driver uses multiple
- * reads checked agains the count register with an
+ * A standard SETUP packet is always 8 bytes, so when the
+ * count register says so we read all of them back to back
+ * and check the count once at the end. Anything else goes
+ * through the old loop which, like write fifo above, uses
+ * multiple reads checked agains the count register with an
  * overall timeout.
  *
  */
@@ -900,20 +1340,43 @@ static int read_fifo( usb_dev_request_t * request )
 
 	fifo_count = ( Ser0UDCWC & 0xFF );
 
-	//PRINTKD( "[%lu]RF=%d ", (jiffies-start_time)*10, fifo_count );
+	//PRINTKD( "[%lu]RF=%d ", NOW_US(), fifo_count );
+
+	if ( fifo_count == sizeof( *request ) ) {
+		for ( bytes_read = 0; bytes_read < sizeof( *request ); bytes_read++ )
+			pOut[bytes_read] = (unsigned char) Ser0UDCD0;
+
+		fifo_count = ( Ser0UDCWC & 0xFF );
+		if ( fifo_count == 0 ) {
+			usbd_info.stats.ep0_rd_fast++;
+			usbd_info.stats.ep0_bytes_read += bytes_read;
+			return bytes_read;
+		}
+
+		/* some read didn't pop, so the request is garbage. Make
+		   the caller stall and let the host send it again */
+		printk( "[%lu]%sread_fifo(): read failure, %d bytes left\n", NOW_US(), pszep0,
+			fifo_count );
+		usbd_info.stats.ep0_fifo_read_failures++;
+		return bytes_read - fifo_count;
+	}
 
+	usbd_info.stats.ep0_rd_fallbacks++;
 	while( fifo_count-- ) {
 		 i = 0;
 		 do {
 			*pOut = (unsigned char) Ser0UDCD0;
 			udelay( 10 );
+			i++;
 		 } while( ( Ser0UDCWC & 0xFF ) != fifo_count && i < 10 );
 		 if ( i == 10 ) {
-			  printk( "[%lu]%sread_fifo(): read failure\n", (jiffies-start_time)*10, pszep0 );
+			  printk( "[%lu]%sread_fifo(): read failure\n", NOW_US(), pszep0 );
+			  usbd_info.stats.ep0_fifo_read_failures++;
 		 }
 		 pOut++;
 		 bytes_read++;
 	}
+	usbd_info.stats.ep0_bytes_read += bytes_read;
 
 	//PRINTKD( "fc=%d\n", bytes_read );
 	return bytes_read;
@@ -925,6 +1388,7 @@ static int read_fifo( usb_dev_request_t * request )
  * for a GET_DESCRIPTOR setup request for the hub
  */
 static void get_hub_descriptor( usb_dev_request_t * pReq ) {
+	const void * p = NULL;
 	int value = 0;
 	int type = pReq->wValue >> 8;
 	int idx  = pReq->wValue & 0xFF;
@@ -932,19 +1396,19 @@ static void get_hub_descriptor( usb_dev_request_t * pReq ) {
 	switch( type ) {
 	case USB_DESC_DEVICE:
 		value = min(pReq->wLength, (u16)hub_device_desc.bLength);
-		memcpy(desc_buf, &hub_device_desc, value);
+		p = &hub_device_desc;
 		break;
 	case USB_DESC_CONFIG:
 		value = min(pReq->wLength, (u16) sizeof(hub_config_descriptor));
-		memcpy(desc_buf, hub_config_descriptor, value);
+		p = hub_config_descriptor;
 		// value = min(pReq->wLength, (u16) hub_config_desc.wTotalLength);
 		// memcpy(desc_buf, &hub_config_desc, value);		
 		break;
 	case USB_DESC_STRING:
-		printk( "[%lu]%sChungo. Desc string\n", (jiffies-start_time)*10, pszep0);
+		printk( "[%lu]%sChungo. Desc string\n", NOW_US(), pszep0);
 		break;
 	case USB_DESC_INTERFACE:
-		printk( "[%lu]%sChungo Desc interface\n", (jiffies-start_time)*10, pszep0);
+		printk( "[%lu]%sChungo Desc interface\n", NOW_US(), pszep0);
 		// if ( idx == hub_interface_desc.bInterfaceNumber ) {
 			// value = min(pReq->wLength, (u16) hub_interface_desc.bLength);
 			// memcpy(desc_buf, &hub_interface_desc, value);
@@ -952,7 +1416,7 @@ static void get_hub_descriptor( usb_dev_request_t * pReq ) {
 		// }
 		break;
 	case USB_DESC_ENDPOINT: /* correct? 21Feb01ww */
-		printk( "[%lu]%sChungo Desc endpoint %d\n", (jiffies-start_time)*10, pszep0, idx);
+		printk( "[%lu]%sChungo Desc endpoint %d\n", NOW_US(), pszep0, idx);
 		// if ( idx == 1 ) {
 			// value = min(pReq->wLength, (u16) hub_endpoint_1.bLength);
 			// memcpy(desc_buf, &hub_endpoint_1, value);
@@ -962,18 +1426,18 @@ static void get_hub_descriptor( usb_dev_request_t * pReq ) {
 			// memcpy(desc_buf, &hub_endpoint_2, value);
 		// }
 		// else
-			// printk("[%lu]%sunkown endpoint index %d Stall.\n", (jiffies-start_time)*10, pszep0, idx );
+			// printk("[%lu]%sunkown endpoint index %d Stall.\n", NOW_US(), pszep0, idx );
 			// cs_bits = ( UDCCS0_DE | UDCCS0_SO | UDCCS0_FST );
 		// }
 		break;
 	default :
-		PRINTKD("[%lu]%sunknown descriptor type %d. Stall.\n", (jiffies-start_time)*10, pszep0, type );
+		PRINTKD("[%lu]%sunknown descriptor type %d. Stall.\n", NOW_US(), pszep0, type );
 		set_cs_bits ( UDCCS0_DE | UDCCS0_SO | UDCCS0_FST );
 		return;
 		break;
 	}
 	if (value > 0) {
-		queue_and_start_write(desc_buf, pReq->wLength, value);
+		queue_and_start_write(p, pReq->wLength, value);
 	}
 	else {
 		set_cs_bits ( UDCCS0_DE | UDCCS0_SO);
@@ -986,65 +1450,38 @@ static void get_hub_descriptor( usb_dev_request_t * pReq ) {
  * for a GET_DESCRIPTOR setup request for the hub
  */
 static void get_device_descriptor(usb_dev_request_t * pReq) {
-	int value = -EOPNOTSUPP;
+	const struct ep0_desc * d;
+	int value = 0;
 	int type = pReq->wValue >> 8;
 	int idx  = pReq->wValue & 0xFF;
 	
 	switch (type) {
 	case USB_DT_DEVICE:
-		switch (currentPort) {
-		case 0:
-			value = min(pReq->wLength, (u16) sizeof(hub_header_desc));
-			memcpy(desc_buf, hub_header_desc, value);
-			break;
-		case 1:
-			value = min(pReq->wLength, (u16) sizeof(port1_device_desc));
-			memcpy(desc_buf, port1_device_desc, value);
-			break;
-		case 2:
-			value = min(pReq->wLength, (u16) sizeof(port2_device_desc));
-			memcpy(desc_buf, port2_device_desc, value);
-			break;
-		case 3:
-			value = min(pReq->wLength, (u16) sizeof(port3_device_desc));
-			memcpy(desc_buf, port3_device_desc, value);
-			break;
-		case 4:
-			value = min(pReq->wLength, (u16) sizeof(port4_device_desc));
-			memcpy(desc_buf, port4_device_desc, value);
-			break;
-		case 5:
-			value = min(pReq->wLength, (u16) sizeof(port5_device_desc));
-			memcpy(desc_buf, port5_device_desc, value);
-			break;
-		default:
-			value = -EINVAL;
-			break;
-		}
+		d = ep0_desc_lookup(currentPort, EP0_DESC_DEVICE, idx, pReq->wLength);
+		if (d)
+			value = min(pReq->wLength, (u16) d->len);
 		break;
 	case USB_DT_CONFIG:
-		value = 0;
+		if (currentPort == 0) {
+			printk( "[%lu]Chungo currentPort 0\n", NOW_US());
+			d = NULL;
+			break;
+		}
+		d = ep0_desc_lookup(currentPort, EP0_DESC_CONFIG, idx, pReq->wLength);
+		if (d)
+			value = min(pReq->wLength, (u16) d->len);
+
+		/* The long read of the last config is what moves each port along */
 		switch (currentPort) {
 		case 1:
-			if (idx < PORT1_NUM_CONFIGS) {
-				if (pReq->wLength == 8) {
-					value = sizeof(port1_short_config_desc);
-					memcpy(desc_buf, port1_short_config_desc, value);
-				} else {
-					value = port1_config_desc_size;
-					memcpy(desc_buf, port1_config_desc, value);
-				}
-				if (idx == (PORT1_NUM_CONFIGS-1) && pReq->wLength > 8) {
-					machine_state = DEVICE1_READY;
-					switch_to_port_delayed = 0;
-					// SET_TIMER (100); // log 90 jb 100
-				}
+			if (idx == (PORT1_NUM_CONFIGS-1) && pReq->wLength > 8) {
+				machine_state = DEVICE1_READY;
+				switch_to_port_delayed = 0;
+				// SET_TIMER (100); // log 90 jb 100
 			}
-			PRINTKD( "[%lu]Device Req type %d, idx %d reqlen %d serve %d\n", (jiffies-start_time)*10, type, idx, pReq->wLength, value);
+			PRINTKD( "[%lu]Device Req type %d, idx %d reqlen %d serve %d\n", NOW_US(), type, idx, pReq->wLength, value);
 			break;
 		case 2:
-			value = sizeof(port2_config_desc);
-			memcpy(desc_buf, port2_config_desc, value);
 			if (pReq->wLength > 8) {
 				machine_state = DEVICE2_READY;
 				switch_to_port_delayed = 0;
@@ -1052,8 +1489,6 @@ static void get_device_descriptor(usb_dev_request_t * pReq) {
 			}
 			break;
 		case 3:
-			value = sizeof(port3_config_desc);
-			memcpy(desc_buf, port3_config_desc, value);
 			if (idx == 1 && pReq->wLength > 8) {
 				machine_state = DEVICE3_READY;
 				switch_to_port_delayed = 0;
@@ -1061,55 +1496,34 @@ static void get_device_descriptor(usb_dev_request_t * pReq) {
 			}
 			break;
 		case 4:
-			if (idx == 0) {
-				value = sizeof(port4_config_desc_1);
-				memcpy(desc_buf, port4_config_desc_1, value);
-			} else if (idx == 1) {
-				if (pReq->wLength == 8) {
-					value = sizeof(port4_short_config_desc_2);
-					memcpy(desc_buf, port4_short_config_desc_2, value);
-				} else {
-					value = sizeof(port4_config_desc_2);
-					memcpy(desc_buf, port4_config_desc_2, value);
-				}
-			} else if (idx == 2) {
-				value = sizeof(port4_config_desc_3);
-				memcpy(desc_buf, port4_config_desc_3, value);
-				if (pReq->wLength > 8) {
-					machine_state = DEVICE4_READY;
-					switch_to_port_delayed = 0;
-					// SET_TIMER (10); // log 0 jb 180
-				}
+			if (idx == 2 && pReq->wLength > 8) {
+				machine_state = DEVICE4_READY;
+				switch_to_port_delayed = 0;
+				// SET_TIMER (10); // log 0 jb 180
 			}
 			break;
-		case 5:
-			value = sizeof(port5_config_desc);
-			memcpy(desc_buf, port5_config_desc, value);
-			break;
-		default:
-			value = -EINVAL;
-			printk( "[%lu]Chungo currentPort 0\n", (jiffies-start_time)*10);
-			break;
 		}
-		if (value >= 0)
-			value = min(pReq->wLength, (u16)value);
 		break;
 	case USB_DT_STRING:
-		value = 0;
-		PRINTKI( "[%lu]String Req type %d, idx %d reqlen %d\n", (jiffies-start_time)*10, type, idx, pReq->wLength);
+		d = NULL;
+		PRINTKI( "[%lu]String Req type %d, idx %d reqlen %d\n", NOW_US(), type, idx, pReq->wLength);
 		break;
 	case 0x29: // HUB descriptor (always to port 0 we'll assume)
+		d = ep0_desc_lookup(currentPort, EP0_DESC_HUB, idx, pReq->wLength);
 		if (currentPort) {
-			printk( "[%lu]Error hub_descriptor request for port %d\n", (jiffies-start_time)*10, currentPort);
+			printk( "[%lu]Error hub_descriptor request for port %d\n", NOW_US(), currentPort);
 		}
-		else {
-			value = min(pReq->wLength, (u16) sizeof(hub_header_desc));
-			memcpy(desc_buf, hub_header_desc, value);
+		else if (d) {
+			value = min(pReq->wLength, (u16) d->len);
 		}
-		break;		
+		break;
+	default:
+		d = NULL;
+		break;
 	}
 	if (value > 0) {
-		queue_and_start_write(desc_buf, pReq->wLength, value);
+		/* stream straight out of the const table, no copy */
+		queue_and_start_write(d->p, pReq->wLength, value);
 	}
 	else {
 		set_cs_bits( UDCCS0_DE | UDCCS0_SO);
@@ -1125,10 +1539,11 @@ static int jig_set_config()
 	ep2_reset();
 	//jig_reset_config();
    
-	PRINTKI( "[%lu]Enabled BULK OUT endpoint\n", (jiffies-start_time)*10);
-	PRINTKI( "[%lu]Enabled BULK IN endpoint\n", (jiffies-start_time)*10);
+	PRINTKI( "[%lu]Enabled BULK OUT endpoint\n", NOW_US());
+	PRINTKI( "[%lu]Enabled BULK IN endpoint\n", NOW_US());
 	
-	result = sa1100_usb_recv(desc_buf, 8, jig_interrupt_complete);
+	/* the whole challenge in one go, ep1 re-arms between packets */
+	result = sa1100_usb_recv(desc_buf, 64, jig_interrupt_complete);
 
   return result;
 }
@@ -1138,69 +1553,93 @@ static void jig_interrupt_complete(int flag, int size) {
 	// int flags = 0;
 
 //	spin_lock_irqsave (&dev->lock, flags);
-	PRINTKI("[%lu]******Out interrupt complete (status %d) : length %d, actual %d\n", (jiffies-start_time)*10, flag, 8, size);
+	PRINTKI("[%lu]******Out interrupt complete (status %d) : length %d, actual %d\n", NOW_US(), flag,
+		64 - challenge_len, size);
 
 	if (!flag) {
 		/* normal completion */
 		/* TODO handle data */
 		challenge_len += size;
-		PRINTKI("[%lu]************Challenge length : %d\n", (jiffies-start_time)*10, challenge_len);
+		PRINTKI("[%lu]************Challenge length : %d\n", NOW_US(), challenge_len);
 		if (challenge_len >= 64) {
 			machine_state = DEVICE5_CHALLENGED;
 			SET_TIMER (450);
 		}
 		else {
-			result = sa1100_usb_recv(desc_buf, 8, jig_interrupt_complete);
+			/* short packet: wait for the rest */
+			result = sa1100_usb_recv((char *)desc_buf + challenge_len, 64 - challenge_len,
+				jig_interrupt_complete);
 		}
 	}
 	else {
-		printk("[%lu]gone (%d)\n", (jiffies-start_time)*10, flag);
+		printk("[%lu]gone (%d)\n", NOW_US(), flag);
 	}
 
 	// spin_unlock_irqrestore (&dev->lock, flags);
 }
 
+/*
+ * The challenge response lives in consistent memory from load time on and
+ * goes out as a single ep2 request; ep2 splits it into tx_pktsize packets.
+ */
+static struct usb_request jig_response_req;
+static char *jig_response_mem;
+static dma_addr_t jig_response_dma;
+
+int jig_response_init(void)
+{
+	jig_response_mem = consistent_alloc(GFP_KERNEL, sizeof(jig_response), &jig_response_dma);
+	if (!jig_response_mem)
+		return -ENOMEM;
+	memcpy(jig_response_mem, jig_response, sizeof(jig_response));
+
+	jig_response_req.buf = jig_response_mem;
+	jig_response_req.length = sizeof(jig_response);
+	jig_response_req.dma = jig_response_dma;
+	jig_response_req.complete = jig_response_complete;
+	return 0;
+}
+
+void jig_response_exit(void)
+{
+	if (jig_response_mem)
+		consistent_free(jig_response_mem, sizeof(jig_response), jig_response_dma);
+	jig_response_mem = NULL;
+}
+
 /* Send the challenge response */
 static void jig_response_send (void)
 {
 	int result;
+
+	/* a second pass through DEVICE5_CHALLENGED while it is still going out */
+	if (jig_response_req.status == -EINPROGRESS) {
+		PRINTKI( "[%lu]response already on its way\n", NOW_US());
+		return;
+	}
 	
-	memcpy (desc_buf, jig_response + response_len, 8);
-	
-	PRINTKI( "[%lu]transmitting response. Sent so far %d\n", (jiffies-start_time)*10, response_len);
-	PRINTKI( "[%lu]Sending %X %X %X %X %X %X %X %X\n", (jiffies-start_time)*10, 
-			((char *)desc_buf)[0], ((char *)desc_buf)[1],
-			((char *)desc_buf)[2], ((char *)desc_buf)[3],
-			((char *)desc_buf)[4], ((char *)desc_buf)[5],
-			((char *)desc_buf)[6], ((char *)desc_buf)[7]);
-
-	result = sa1100_usb_send(desc_buf, 8, jig_response_complete);
+	PRINTKI( "[%lu]transmitting response, %d bytes\n", NOW_US(), jig_response_req.length);
+
+	result = sa1100_usb_ep_queue(2, &jig_response_req);
 	
 	if (result) {
 		printk( "jig_response_send send_retcode %d\n", result);
 	}
 }
 
-static void jig_response_complete(int flag, int size) {
+static void jig_response_complete(struct usb_request *req) {
 	// int flags;
 
 	//spin_lock_irqsave (&dev->lock, flags);
-	PRINTKI("[%lu]Jig response sent (status %d). Sent data so far : %d + %d\n", (jiffies-start_time)*10, flag, response_len, 8);
+	PRINTKI("[%lu]Jig response sent (status %d) : length %d, actual %d\n", NOW_US(),
+		req->status, req->length, req->actual);
 
-	if (!flag) {
-        /* our transmit completed.
-           see if there's more to go.
-           hub_transmit eats req, don't queue it again. */
-        response_len += size;
-        if (response_len < 64) {
-			jig_response_send ();
-        } else {
-			machine_state = DEVICE5_READY;
-			SET_TIMER (10);
-        }
-    }
+	if (!req->status && req->actual == req->length) {
+		machine_state = DEVICE5_READY;
+		SET_TIMER_HOP ();
+	}
 	else {
-		printk("[%lu]gone (%d)\n", (jiffies-start_time)*10, flag);
+		printk("[%lu]gone (%d)\n", NOW_US(), req->status);
 	}
 
 	//spin_unlock_irqrestore (&dev->lock, flags);
@@ -1223,22 +1662,124 @@ static void set_cs_bits( __u32 bits )
 		set_de();
 }
 
+/*
+ * Setting DE or IPR doesn't always stick on the first write. The old way
+ * was to spin with growing delays (up to ~1.2 ms) inside the interrupt
+ * until the bit read back. With ep0_cs_async we write it once; if it
+ * doesn't read back we remember it as pending and either the next ep0
+ * interrupt (meaning the UDC acted on it, or the host moved on) or a
+ * short OS timer retry finishes the job.
+ */
+#define EP0_CS_RETRY_US		20
+#define EP0_CS_MAX_TRIES	50
+
+static __u32 ep0_cs_pending;
+static __u32 ep0_cs_t0;
+static int ep0_cs_tries;
+static struct ost_event ep0_cs_event;
+
+static void ep0_cs_timeout( unsigned long data )
+{
+	ep0_cs_confirm( 0 );
+}
+
+static void ep0_cs_done( void )
+{
+	__u32 dt = OSCR - ep0_cs_t0;
+
+	usbd_info.stats.ep0_cs_confirmed++;
+	usbd_info.stats.ep0_cs_confirm_ticks += dt;
+	if ( dt > usbd_info.stats.ep0_cs_confirm_max_ticks )
+		usbd_info.stats.ep0_cs_confirm_max_ticks = dt;
+	ep0_cs_pending = 0;
+	ost_del( &ep0_cs_event );
+}
+
+static void ep0_cs_cancel( void )
+{
+	ep0_cs_pending = 0;
+	ost_del( &ep0_cs_event );
+}
+
+/* write bits into UDCCS0 once, leave them pending if they didn't stick */
+static void ep0_cs_set( __u32 bits )
+{
+	if ( !OK_TO_WRITE ) {
+		PRINTKD( "[%lu]%sQuitting set %#x because SST or SE set (%d)\n", NOW_US(), pszep0,
+			bits, Ser0UDCCS0);
+		return;
+	}
+
+	Ser0UDCCS0 |= bits;
+	usbd_info.stats.ep0_cs_writes++;
+	if ( (Ser0UDCCS0 & bits) == bits )
+		return;
+
+	usbd_info.stats.ep0_cs_first_fail++;
+	if ( !ep0_cs_pending ) {
+		ep0_cs_t0 = OSCR;
+		ep0_cs_tries = 1;
+	}
+	ep0_cs_pending |= bits;
+	if ( !ep0_cs_event.function )
+		ost_init_event( &ep0_cs_event, ep0_cs_timeout, 0 );
+	ost_add( &ep0_cs_event, EP0_CS_RETRY_US );
+}
+
+static void ep0_cs_confirm( int from_irq )
+{
+	if ( !ep0_cs_pending )
+		return;
+
+	if ( from_irq || (Ser0UDCCS0 & ep0_cs_pending) == ep0_cs_pending ) {
+		ep0_cs_done();
+		return;
+	}
+
+	if ( !OK_TO_WRITE ) {
+		PRINTKD( "[%lu]%sQuitting pending set %#x because SST or SE set (%d)\n", NOW_US(),
+			pszep0, ep0_cs_pending, Ser0UDCCS0);
+		ep0_cs_cancel();
+		return;
+	}
+
+	if ( ++ep0_cs_tries == EP0_CS_MAX_TRIES ) {
+		printk( "[%lu]Dangnabbbit! Cannot set %#x! (CCS0=%8.8X)\n", NOW_US(),
+			ep0_cs_pending, Ser0UDCCS0 );
+		usbd_info.stats.ep0_cs_giveups++;
+		ep0_cs_cancel();
+		return;
+	}
+
+	usbd_info.stats.ep0_cs_retries++;
+	Ser0UDCCS0 |= ep0_cs_pending;
+	if ( (Ser0UDCCS0 & ep0_cs_pending) == ep0_cs_pending )
+		ep0_cs_done();
+	else
+		ost_add( &ep0_cs_event, EP0_CS_RETRY_US );
+}
+
 static void set_de( void )
 {
 	int i = 1;
 
+	if ( ep0_cs_async ) {
+		ep0_cs_set( UDCCS0_DE );
+		return;
+	}
+
 	while( 1 ) {
 		if ( OK_TO_WRITE ) {
 			Ser0UDCCS0 |= UDCCS0_DE;
 		} else {
-			PRINTKD( "[%lu]%sQuitting set DE because SST or SE set\n", (jiffies-start_time)*10, pszep0 );
+			PRINTKD( "[%lu]%sQuitting set DE because SST or SE set\n", NOW_US(), pszep0 );
 			break;
 		}
 		if ( Ser0UDCCS0 & UDCCS0_DE )
 			break;
 		udelay( i );
 		if ( ++i == 50  ) {
-			printk( "[%lu]Dangnabbbit! Cannot set DE! (DE=%8.8X CCS0=%8.8X)\n", (jiffies-start_time)*10,
+			printk( "[%lu]Dangnabbbit! Cannot set DE! (DE=%8.8X CCS0=%8.8X)\n", NOW_US(),
 					   UDCCS0_DE, Ser0UDCCS0 );
 			break;
 		}
@@ -1248,18 +1789,24 @@ static void set_de( void )
 static void set_ipr( void )
 {
 	int i = 1;
+
+	if ( ep0_cs_async ) {
+		ep0_cs_set( UDCCS0_IPR );
+		return;
+	}
+
 	while( 1 ) {
 		if ( OK_TO_WRITE ) {
 			Ser0UDCCS0 |= UDCCS0_IPR;
 		} else {
-			PRINTKD( "[%lu]Quitting set IPR because SST or SE set (%d)\n", (jiffies-start_time)*10, Ser0UDCCS0);
+			PRINTKD( "[%lu]Quitting set IPR because SST or SE set (%d)\n", NOW_US(), Ser0UDCCS0);
 			break;
 		}
 		if ( Ser0UDCCS0 & UDCCS0_IPR )
 			break;
 		udelay( i );
 		if ( ++i == 50  ) {
-			printk( "[%lu]Dangnabbbit! Cannot set IPR! (IPR=%8.8X CCS0=%8.8X)\n", (jiffies-start_time)*10,
+			printk( "[%lu]Dangnabbbit! Cannot set IPR! (IPR=%8.8X CCS0=%8.8X)\n", NOW_US(),
 					UDCCS0_IPR, Ser0UDCCS0 );
 			break;
 		}
@@ -1269,11 +1816,17 @@ static void set_ipr( void )
 static void set_ipr_and_de( void )
 {
 	int i = 1;
+
+	if ( ep0_cs_async ) {
+		ep0_cs_set( BOTH_BITS );
+		return;
+	}
+
 	while( 1 ) {
 		if ( OK_TO_WRITE ) {
 			Ser0UDCCS0 |= BOTH_BITS;
 		} else {
-			PRINTKD( "[%lu]%sQuitting set IPR/DE because SST or SE set (%d)\n", (jiffies-start_time)*10, pszep0, Ser0UDCCS0);
+			PRINTKD( "[%lu]%sQuitting set IPR/DE because SST or SE set (%d)\n", NOW_US(), pszep0, Ser0UDCCS0);
 			break;
 		}
 		if ( (Ser0UDCCS0 & BOTH_BITS) == BOTH_BITS)
@@ -1281,7 +1834,7 @@ static void set_ipr_and_de( void )
 			
 		udelay( i );
 		if ( ++i == 50  ) {
-			printk( "[%lu]Dangnabbbit! Cannot set DE/IPR! (DE=%8.8X IPR=%8.8X CCS0=%8.8X)\n", (jiffies-start_time)*10,
+			printk( "[%lu]Dangnabbbit! Cannot set DE/IPR! (DE=%8.8X IPR=%8.8X CCS0=%8.8X)\n", NOW_US(),
 				UDCCS0_DE, UDCCS0_IPR, Ser0UDCCS0 );
 			break;
 		}
@@ -1296,7 +1849,7 @@ static bool clear_opr( void )
 		Ser0UDCCS0 = UDCCS0_SO;
 		is_clear  = ! ( Ser0UDCCS0 & UDCCS0_OPR );
 		if ( i-- <= 0 ) {
-			printk( "[%lu]clear_opr(): failed\n", (jiffies-start_time)*10);
+			printk( "[%lu]clear_opr(): failed\n", NOW_US());
 			break;
 		}
 	} while( ! is_clear );
@@ -21,60 +21,159 @@
 #include <asm/system.h>
 #include "usb_ctl.h"
 
-//static char *ep1_buf;
-static int ep1_len;
-static usb_callback_t ep1_callback;
-static char *ep1_curdmabuf;
-static dma_addr_t ep1_curdmapos;
-static int ep1_curdmalen;
-static int ep1_remain;
+/*
+ * Receive staging. The DMA always writes into one of two buffers in
+ * consistent memory, and RPC is released as soon as the packet is out
+ * of the FIFO, whether or not anybody has asked for it yet. Packets are
+ * copied to the caller's buffer from there. The host only gets NAKed
+ * while both buffers hold data nobody has taken.
+ */
+#define EP1_RXBUFS		2
+#define EP1_RXBUF_SIZE		64	/* >= rx_pktsize */
+
+struct ep1_rxbuf {
+	char *data;
+	dma_addr_t dma;
+	int len;			/* bytes received */
+	int pos;			/* bytes already handed out */
+	int full;
+};
+
+static struct ep1_rxbuf ep1_rx[EP1_RXBUFS];
+static char *ep1_rx_mem;
+static dma_addr_t ep1_rx_mem_dma;
+static int ep1_rx_dma;			/* buffer the DMA is filling */
+static int ep1_rx_head;			/* oldest full buffer */
+static int ep1_rx_armed;
+static __u32 ep1_nak_t0;		/* OSCR when a NAK hold began, 0 = none */
+
+/* requests queued on ep1, filled in order from the staging buffers */
+static struct usb_request *ep1_head;
+static struct usb_request *ep1_tail;
 static dma_regs_t *dmachn_rx;
 
+/* the sa1100_usb_recv() caller's transfer */
+static struct usb_request ep1_legacy_req;
+static usb_callback_t ep1_callback;
+
 static int naking;
 
+/* RPC stays set past the interrupt: the host gets NAKed until ep1_start() */
+static void ep1_nak_begin(void)
+{
+	naking = 1;
+	if (!ep1_nak_t0)
+		ep1_nak_t0 = OSCR | 1;
+}
+
+/* point the DMA at a free staging buffer and let the host send again */
 static void ep1_start(void)
 {
-	PRINTKD( "[%lu]ep1_start dma_len %d remain %d pkt %d\n", (jiffies-start_time)*10, ep1_curdmalen, ep1_remain,
-		rx_pktsize);
-	
-	sa1100_clear_dma(dmachn_rx);
-	
-	if (!ep1_curdmalen) {
-		// ep1_curdmalen is min (rx_pktsize , ep1_remain) 
-	  	ep1_curdmalen = rx_pktsize;
-		if (ep1_curdmalen > ep1_remain)
-			ep1_curdmalen = ep1_remain;
+	struct ep1_rxbuf *b;
 
-		ep1_curdmapos = pci_map_single(NULL, ep1_curdmabuf, ep1_curdmalen, PCI_DMA_FROMDEVICE);
+	if (ep1_rx_armed || !ep1_rx_mem)
+		return;
+	b = &ep1_rx[ep1_rx_dma];
+	if (b->full) {
+		b = &ep1_rx[ep1_rx_dma ^ 1];
+		if (b->full)
+			return;		/* both taken: keep NAKing */
+		ep1_rx_dma ^= 1;
 	}
 
-	UDC_write( Ser0UDCOMP, ep1_curdmalen - 1);
-	
-	sa1100_start_dma(dmachn_rx, ep1_curdmapos, ep1_curdmalen);
+	PRINTKD( "[%lu]ep1_start buf %d pkt %d\n", NOW_US(), ep1_rx_dma, rx_pktsize);
+
+	sa1100_clear_dma(dmachn_rx);
+	UDC_write( Ser0UDCOMP, rx_pktsize - 1);
+	sa1100_start_dma(dmachn_rx, b->dma, rx_pktsize);
+	ep1_rx_armed = 1;
 
 	if ( naking ) {
 		/* turn off NAK of OUT packets, if set */
 		UDC_flip( Ser0UDCCS1, UDCCS1_RPC );
 		naking = 0;
 	}
+	if ( ep1_nak_t0 ) {
+		__u32 dt = OSCR - ep1_nak_t0;
+
+		ep1_nak_t0 = 0;
+		usbd_info.stats.ep1_nak_holds++;
+		usbd_info.stats.ep1_nak_ticks += dt;
+		if (dt > usbd_info.stats.ep1_nak_max_ticks)
+			usbd_info.stats.ep1_nak_max_ticks = dt;
+	}
 }
 
+/* take req off the queue; irqs off */
+static void ep1_unlink(struct usb_request *req)
+{
+	struct usb_request **pp;
+
+	for (pp = &ep1_head; *pp; pp = &(*pp)->next) {
+		if (*pp == req) {
+			*pp = req->next;
+			break;
+		}
+	}
+	if (ep1_tail == req) {
+		ep1_tail = ep1_head;
+		while (ep1_tail && ep1_tail->next)
+			ep1_tail = ep1_tail->next;
+	}
+	req->next = NULL;
+}
+
+/* complete the request at the head of the queue */
 static void ep1_done(int flag)
 {
-	int size = ep1_len - ep1_remain;
+	struct usb_request *req = ep1_head;
 
-	PRINTKD( "[%lu]ep1_done len %d remain %d\n", (jiffies-start_time)*10, ep1_len, ep1_remain);	
-	
-	if (!ep1_len)
+	if (!req)
 		return;
+
+	PRINTKD( "[%lu]ep1_done len %d actual %d\n", NOW_US(), req->length, req->actual);	
 		
-	if (ep1_curdmalen)
-		pci_unmap_single(NULL, ep1_curdmapos, ep1_curdmalen, PCI_DMA_FROMDEVICE);
-		
-	ep1_len = ep1_curdmalen = 0;
+	ep1_unlink(req);
+	req->status = flag;
+	usbd_info.stats.ep1_rx_xfers++;
 	
-	if (ep1_callback) {
-		ep1_callback(flag, size);
+	udc_complete(req);
+}
+
+/* fail every queued request, after a reset */
+static void ep1_flush(int flag)
+{
+	while (ep1_head)
+		ep1_done(flag);
+}
+
+/*
+ * Hand staged packets to the pending receive. A transfer may span
+ * several packets and completes when it is full or after a short packet.
+ */
+static void ep1_deliver(void)
+{
+	struct usb_request *req;
+	struct ep1_rxbuf *b;
+	int n, shrt;
+
+	while ((req = ep1_head) && ep1_rx[ep1_rx_head].full) {
+		b = &ep1_rx[ep1_rx_head];
+		n = b->len - b->pos;
+		if (n > req->length - req->actual)
+			n = req->length - req->actual;
+		memcpy(req->buf + req->actual, b->data + b->pos, n);
+		req->actual += n;
+		b->pos += n;
+
+		shrt = b->len < rx_pktsize;
+		if (b->pos == b->len) {
+			b->full = 0;
+			ep1_rx_head ^= 1;
+			ep1_start();
+		}
+		if (req->actual == req->length || shrt)
+			ep1_done(req->actual ? 0 : -EPIPE);
 	}
 }
 
@@ -84,12 +183,25 @@ void ep1_stall( void )
 	UDC_set( Ser0UDCCS1, UDCCS1_FST );
 }
 
+/* drop whatever is staged; the DMA gets re-armed by the next receive */
+static void ep1_discard(void)
+{
+	int i;
+
+	for (i = 0; i < EP1_RXBUFS; i++)
+		ep1_rx[i].full = 0;
+	ep1_rx_dma = ep1_rx_head = 0;
+	ep1_rx_armed = 0;
+	ep1_nak_t0 = 0;
+}
+
 int ep1_init(dma_regs_t *chn)
 {
 	UDC_write( Ser0UDCOMP, rx_pktsize-1 );
 	dmachn_rx = chn;
 	sa1100_clear_dma(dmachn_rx);
-	ep1_done(-EAGAIN);
+	ep1_discard();
+	ep1_flush(-EAGAIN);
 	return 0;
 }
 
@@ -105,29 +217,33 @@ void ep1_reset(void)
 
 	sa1100_clear_dma(dmachn_rx);
 	UDC_clear(Ser0UDCCS1, UDCCS1_FST);
-	ep1_done(-EINTR);
+	ep1_discard();
+	ep1_flush(-EINTR);
 }
 
 void ep1_int_hndlr()
 {
+	struct ep1_rxbuf *b;
 	dma_addr_t dma_addr;
 	unsigned int len;
 	int status = Ser0UDCCS1;
 
-	PRINTKD( "[%lu]Ep1 int %d\n", (jiffies-start_time)*10, status);
+	PRINTKD( "[%lu]Ep1 int %d\n", NOW_US(), status);
 	
 	if ( naking )
 		printk( "%sEh? in ISR but naking = %d\n", "usbrx: ", naking );
 
 	// Reive packet complete
 	if (status & UDCCS1_RPC) {
-		if (!ep1_curdmalen) {
+		if (!ep1_rx_armed) {
 			printk("usb_recv: RPC for non-existent buffer\n");
-			naking = 1;
+			ep1_nak_begin();
 			return;
 		}
 
 		sa1100_stop_dma(dmachn_rx);
+		ep1_rx_armed = 0;
+		b = &ep1_rx[ep1_rx_dma];
 
 		if (status & UDCCS1_SST) {
 			printk("usb_recv: stall sent OMP=%d\n",Ser0UDCOMP);
@@ -140,18 +256,17 @@ void ep1_int_hndlr()
 		    printk("usb_recv: RPError %x\n", status);
 			UDC_flip(Ser0UDCCS1, UDCCS1_RPC);
 			ep1_done(-EIO);
+			ep1_start();
 			return;
 		}
 
 		dma_addr = sa1100_get_dma_pos(dmachn_rx);
-		pci_unmap_single(NULL, ep1_curdmapos, ep1_curdmalen, PCI_DMA_FROMDEVICE);
-		
-		len = dma_addr - ep1_curdmapos;
+		len = dma_addr - b->dma;
 
-		if (len < ep1_curdmalen) {
-			char *buf = ep1_curdmabuf + len;
+		if (len < rx_pktsize) {
+			char *buf = b->data + len;
 			while (Ser0UDCCS1 & UDCCS1_RNE) {
-				if (len >= ep1_curdmalen) {
+				if (len >= rx_pktsize) {
 					printk("usb_recv: too much data in fifo\n");
 					break;
 				}
@@ -162,30 +277,132 @@ void ep1_int_hndlr()
 			printk("usb_recv: fifo screwed, shouldn't contain data\n");
 			len = 0;
 		}
-		ep1_curdmalen = 0;  /* dma unmap already done */
-		ep1_remain -= len;
+		b->len = len;
+		b->pos = 0;
+		b->full = 1;
+		usbd_info.stats.ep1_rx_packets++;
+
+		/* packet is out of the FIFO: reopen on the other buffer if it is free */
 		naking = 1;
-		ep1_done((len) ? 0 : -EPIPE);
+		ep1_start();
+		if (ep1_rx_armed)
+			usbd_info.stats.ep1_rx_rearms++;
+		else
+			ep1_nak_begin();
+		ep1_deliver();
 	}
 	/* else, you can get here if we are holding NAK */
 }
 
-int sa1100_usb_recv(char *buf, int len, usb_callback_t callback)
+/*
+ * ep1_queue()
+ * Queue req for the next OUT data. Packets already staged are handed
+ * over right away, so the completion may run before this returns.
+ */
+int ep1_queue(struct usb_request *req)
 {
 	int flags;
 
-	if (ep1_len)
-		return -EBUSY;
+	if (req->length <= 0)
+		return -EINVAL;
 
 	local_irq_save(flags);
-	//ep1_buf = buf;
-	ep1_len = len;
-	ep1_callback = callback;
-	ep1_remain = len;
-	ep1_curdmabuf = buf;
-	ep1_curdmalen = 0;
+	/* already queued: linking it again would loop the list */
+	if (req->status == -EINPROGRESS) {
+		local_irq_restore(flags);
+		return -EBUSY;
+	}
+	req->actual = 0;
+	req->status = -EINPROGRESS;
+	req->next = NULL;
+	req->queued = OSCR;
+	if (ep1_tail)
+		ep1_tail->next = req;
+	else
+		ep1_head = req;
+	ep1_tail = req;
+
+	ep1_deliver();
 	ep1_start();
 	local_irq_restore(flags);
 
 	return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * ep1_dequeue()
+ * Cancel req; its completion runs with -ECONNRESET. Whatever part of a
+ * packet it had taken stays consumed.
+ */
+int ep1_dequeue(struct usb_request *req)
+{
+	struct usb_request *r;
+	int flags;
+
+	local_irq_save(flags);
+	for (r = ep1_head; r && r != req; r = r->next)
+		;
+	if (!r) {
+		local_irq_restore(flags);
+		return -EINVAL;
+	}
+	ep1_unlink(req);
+	req->status = -ECONNRESET;
+	udc_complete(req);
+	local_irq_restore(flags);
+	return 0;
+}
+
+static void ep1_legacy_complete(struct usb_request *req)
+{
+	usb_callback_t callback = ep1_callback;
+
+	ep1_callback = NULL;
+	req->context = NULL;
+	if (callback)
+		callback(req->status, req->actual);
+}
+
+int sa1100_usb_recv(char *buf, int len, usb_callback_t callback)
+{
+	struct usb_request *req = &ep1_legacy_req;
+	int result;
+
+	/* context marks the wrapper busy */
+	if (req->context)
+		return -EBUSY;
+
+	req->buf = buf;
+	req->length = len;
+	req->dma = 0;
+	req->complete = ep1_legacy_complete;
+	req->context = req;
+	ep1_callback = callback;
+	result = ep1_queue(req);
+	if (result)
+		req->context = NULL;
+	return result;
+}
+
+int ep1_rx_init(void)
+{
+	int i;
+
+	ep1_rx_mem = consistent_alloc(GFP_KERNEL, EP1_RXBUFS * EP1_RXBUF_SIZE, &ep1_rx_mem_dma);
+	if (!ep1_rx_mem)
+		return -ENOMEM;
+	for (i = 0; i < EP1_RXBUFS; i++) {
+		ep1_rx[i].data = ep1_rx_mem + i * EP1_RXBUF_SIZE;
+		ep1_rx[i].dma = ep1_rx_mem_dma + i * EP1_RXBUF_SIZE;
+	}
+	ep1_discard();
+	return 0;
+}
+
+void ep1_rx_exit(void)
+{
+	if (ep1_rx_mem)
+		consistent_free(ep1_rx_mem, EP1_RXBUFS * EP1_RXBUF_SIZE, ep1_rx_mem_dma);
+	ep1_rx_mem = NULL;
+	ep1_discard();
+}
@@ -19,14 +19,13 @@
 #include <linux/module.h>
 #include <linux/pci.h>
 #include <linux/errno.h>
+#include <linux/slab.h>
 #include <asm/hardware.h>
 #include <asm/dma.h>
 #include <asm/system.h>
 #include <asm/byteorder.h>
 #include "usb_ctl.h"
 
-//#define SA1100_USB_DMA_WORKAROUND
-#ifdef SA1100_USB_DMA_WORKAROUND
 typedef struct {
   volatile u_long ddar;
   volatile u_long set_dcsr;
@@ -37,20 +36,90 @@ typedef struct {
   volatile dma_addr_t dbsb;
   volatile u_long dbtb;
 } tx_dma_regs_t;
-#endif
 
 static char *ep2_buf;
 static int ep2_len;
 static int ep2_curdmalen;
 static int ep2_remain;
-static usb_callback_t ep2_callback;
 static dma_addr_t ep2_dma;
 static dma_addr_t ep2_curdmapos;
 static dma_regs_t *dmachn_tx;
+static int ep2_mapped;			/* ep2_dma came from pci_map_single() */
+static int ep2_mode;			/* EP2_TX_DMA or EP2_TX_PIO, current transfer */
+static __u32 ep2_t0;			/* OSCR when it started */
+
+/*
+ * A packet that ends in TPE or TUR is sent again from the interrupt,
+ * up to ep2_retry_pkt times in a row and ep2_retry_xfer times over the
+ * whole transfer, before the transfer fails with -EIO. 0 = no retries.
+ */
+static int ep2_retry_pkt = 3;
+static int ep2_retry_xfer = 8;
+static int ep2_pkt_retries;		/* current packet */
+static int ep2_xfer_retries;		/* current transfer */
+
+/*
+ * Transfers of EP2_PIO_MAX bytes or less on a port set in ep2_pio are
+ * written straight into the FIFO: no mapping, no DMA setup, and no
+ * waiting for the DMA to notice. Bit n is emulated port n (0 = hub).
+ */
+#define EP2_PIO_MAX		8
+static int ep2_pio = 0x3f;
+
+/*
+ * Transmit buffer pool. Hub status bytes and jig response chunks are tiny,
+ * so cleaning the cache for them on every send costs more than the
+ * transfer. These buffers come from consistent (uncached) memory and are
+ * mapped once at load time; sa1100_usb_send_buf() hands them to the DMA
+ * as they are.
+ */
+#define EP2_POOL_BUFS		8
+#define EP2_POOL_CALIBRATE	4	/* map/unmap rounds to estimate their cost */
+
+static struct usb_txbuf ep2_pool[EP2_POOL_BUFS];
+static char *ep2_pool_mem;
+static dma_addr_t ep2_pool_dma;
+
+/*
+ * Requests queued on ep2. The head is the transfer in progress; the
+ * rest are started by ep2_done() straight from the completion interrupt,
+ * in order.
+ */
+static struct usb_request *ep2_head;
+static struct usb_request *ep2_tail;
+static unsigned long ep2_depth;
+
+/*
+ * sa1100_usb_send() and sa1100_usb_send_buf() callers get one of these
+ * wrapped around their buffer and callback.
+ */
+#define EP2_LEGACY_REQS		8
+
+struct ep2_legacy {
+	struct usb_request req;
+	usb_callback_t callback;
+	struct usb_txbuf *txbuf;
+	int busy;
+};
+
+static struct ep2_legacy ep2_legacy[EP2_LEGACY_REQS];
 
-#ifdef SA1100_USB_DMA_WORKAROUND
 static tx_dma_regs_t *tx_dma_regs;
-#endif
+
+/*
+ * How DMA transfers are fed to the FIFO, chosen at load time:
+ *  EP2_DMA_START     sa1100_start_dma() for each packet, from the TPC interrupt
+ *  EP2_DMA_SPIN      the old SA1100_USB_DMA_WORKAROUND: program the channel
+ *                    ourselves and spin until the packet is in the FIFO
+ *  EP2_DMA_PINGPONG  keep both buffer descriptors loaded so the next packet
+ *                    is in the FIFO while the current one is on the wire;
+ *                    the DMA done interrupt refills the descriptor it freed
+ */
+static int ep2_dma_mode = EP2_DMA_PINGPONG;
+static int ep2_dma_cur;			/* ep2_dma_mode for the current transfer */
+static dma_addr_t ep2_pp_next;		/* next packet to hand to the DMA */
+static int ep2_pp_left;			/* bytes not handed to it yet */
+static int ep2_pp_buf;			/* descriptor to load next, 0 = A */
 
 /* set feature stall executing, async */
 void ep2_stall( void )
@@ -58,7 +127,6 @@ void ep2_stall( void )
 	UDC_set( Ser0UDCCS2, UDCCS2_FST );  /* force stall at UDC */
 }
 
-#ifdef SA1100_USB_DMA_WORKAROUND
 /* The SA1100 USB transmit fifo seems to only work reliably when the
    DMA that feeds it runs in a quiet system.  Or something like that.
    As a workaround, we wait for the DMA to finish before doing
@@ -90,7 +158,102 @@ static void ep2_do_dma (void)
 	;
     }
 }
-#endif
+
+/*
+ * Load free descriptors with the packets that follow, in A/B order as the
+ * DMA consumes them. It only moves data as the FIFO asks for it, so two
+ * packets can be loaded ahead without overrunning anything.
+ */
+static void ep2_pp_load(void)
+{
+	int len;
+
+	while (ep2_pp_left > 0) {
+		len = tx_pktsize;
+		if (len > ep2_pp_left)
+			len = ep2_pp_left;
+
+		if (ep2_pp_buf == 0) {
+			if (tx_dma_regs->rd_dcsr & DCSR_STRTA)
+				break;
+			tx_dma_regs->clr_dcsr = DCSR_DONEA;
+			tx_dma_regs->dbsa = ep2_pp_next;
+			tx_dma_regs->dbta = len;
+			tx_dma_regs->set_dcsr = DCSR_STRTA | DCSR_IE | DCSR_RUN;
+		} else {
+			if (tx_dma_regs->rd_dcsr & DCSR_STRTB)
+				break;
+			tx_dma_regs->clr_dcsr = DCSR_DONEB;
+			tx_dma_regs->dbsb = ep2_pp_next;
+			tx_dma_regs->dbtb = len;
+			tx_dma_regs->set_dcsr = DCSR_STRTB | DCSR_IE | DCSR_RUN;
+		}
+		ep2_pp_buf ^= 1;
+		ep2_pp_next += len;
+		ep2_pp_left -= len;
+		usbd_info.stats.ep2_pp_loads++;
+	}
+}
+
+/* first packet of a ping-pong transfer */
+static void ep2_pp_start(void)
+{
+	sa1100_clear_dma(dmachn_tx);
+	ep2_pp_buf = (tx_dma_regs->rd_dcsr & DCSR_BIU) ? 1 : 0;
+	ep2_pp_next = ep2_curdmapos;
+	ep2_pp_left = ep2_remain;
+	ep2_pp_load();
+}
+
+/*
+ * ep2_dma_done()
+ * DMA channel callback: a descriptor has been emptied into the FIFO.
+ */
+void ep2_dma_done(void *data)
+{
+	int flags;
+
+	/* the ping-pong state is shared with the UDC interrupt and ep2_queue() */
+	local_irq_save(flags);
+	if (ep2_dma_cur == EP2_DMA_PINGPONG && ep2_len) {
+		usbd_info.stats.ep2_pp_irqs++;
+		ep2_pp_load();
+	}
+	local_irq_restore(flags);
+}
+
+/* start to last TPC, per transmit path */
+static void ep2_tx_account(void)
+{
+	__u32 dt = OSCR - ep2_t0;
+
+	usbd_info.stats.ep2_tx_xfers[ep2_mode]++;
+	usbd_info.stats.ep2_tx_ticks[ep2_mode] += dt;
+	if (dt > usbd_info.stats.ep2_tx_max_ticks[ep2_mode])
+		usbd_info.stats.ep2_tx_max_ticks[ep2_mode] = dt;
+}
+
+/* the packet at ep2_curdmapos went out clean */
+static void ep2_tx_ok(void)
+{
+	if (ep2_pkt_retries) {
+		usbd_info.stats.ep2_retry_recovered++;
+		ep2_pkt_retries = 0;
+	}
+}
+
+/* one packet by programmed I/O */
+static void ep2_start_pio(void)
+{
+	const char *p = ep2_buf + (ep2_len - ep2_remain);
+	int i;
+
+	UDC_flip( Ser0UDCCS2, UDCCS2_TPC );  /* stop NAKing IN tokens */
+	UDC_write( Ser0UDCIMP, ep2_curdmalen-1 );
+	Ser0UDCAR = portAddress[currentPort]; // fighting stupid silicon bug
+	for (i = 0; i < ep2_curdmalen; i++)
+		Ser0UDCDR = p[i];
+}
 
 static void ep2_start(void)
 {
@@ -100,6 +263,11 @@ static void ep2_start(void)
 	ep2_curdmalen = tx_pktsize;
 	if (ep2_curdmalen > ep2_remain)
 		ep2_curdmalen = ep2_remain;
+
+	if (ep2_mode == EP2_TX_PIO) {
+		ep2_start_pio();
+		return;
+	}
 	
 	/* must do this _before_ queue buffer.. */
 	UDC_flip( Ser0UDCCS2,UDCCS2_TPC );  /* stop NAKing IN tokens */
@@ -129,32 +297,255 @@ static void ep2_start(void)
 
 	// was this:
 	// sa1100_dma_queue_buffer(dmachn_tx, NULL, ep2_curdmapos, ep2_curdmalen);
-#ifdef SA1100_USB_DMA_WORKAROUND
-	ep2_do_dma ();
-#else
-	sa1100_start_dma(dmachn_tx, ep2_curdmapos, ep2_curdmalen);
-#endif
+	switch (ep2_dma_cur) {
+	case EP2_DMA_SPIN:
+		ep2_do_dma ();
+		break;
+	case EP2_DMA_PINGPONG:
+		ep2_pp_start ();
+		break;
+	default:
+		sa1100_start_dma(dmachn_tx, ep2_curdmapos, ep2_curdmalen);
+		break;
+	}
+}
+
+/* make req the current transfer and start it; irqs off */
+static void ep2_begin(struct usb_request *req)
+{
+	__u32 t0 = OSCR;
+
+	ep2_buf = req->buf;
+	ep2_len = req->length;
+	ep2_t0 = t0;
+	ep2_mode = EP2_TX_DMA;
+	ep2_mapped = 0;
+	ep2_pkt_retries = 0;
+	ep2_xfer_retries = 0;
+	ep2_dma_cur = ep2_dma_mode;
+	if (req->length <= EP2_PIO_MAX && (ep2_pio & (1 << currentPort))) {
+		ep2_mode = EP2_TX_PIO;
+		ep2_dma = 0;
+		if (req->dma)
+			usbd_info.stats.ep2_pool_sends++;
+	} else if (req->dma) {
+		ep2_dma = req->dma;
+		usbd_info.stats.ep2_pool_sends++;
+	} else {
+		ep2_dma = pci_map_single(NULL, req->buf, req->length, PCI_DMA_TODEVICE);
+		ep2_mapped = 1;
+		usbd_info.stats.ep2_map_sends++;
+		usbd_info.stats.ep2_map_ticks += OSCR - t0;
+	}
+	ep2_remain = req->length;
+	ep2_curdmapos = ep2_dma;
+	ep2_start();
+}
+
+/* take req off the queue; irqs off */
+static void ep2_unlink(struct usb_request *req)
+{
+	struct usb_request **pp;
+
+	for (pp = &ep2_head; *pp; pp = &(*pp)->next) {
+		if (*pp == req) {
+			*pp = req->next;
+			break;
+		}
+	}
+	if (ep2_tail == req) {
+		ep2_tail = ep2_head;
+		while (ep2_tail && ep2_tail->next)
+			ep2_tail = ep2_tail->next;
+	}
+	req->next = NULL;
+	ep2_depth--;
 }
 
+/*
+ * The next queued request is started before the completion runs, so
+ * anything it queues lines up behind what was already waiting.
+ */
 static void ep2_done(int flag)
 {
-	int size = ep2_len - ep2_remain;
-	if (ep2_len) {
+	struct usb_request *req = ep2_head;
+	__u32 wait;
+
+	if (!ep2_len || !req)
+		return;
+
+	if (ep2_mapped) {
+		__u32 t0 = OSCR;
 		pci_unmap_single(NULL, ep2_dma, ep2_len, PCI_DMA_TODEVICE);
-		ep2_len = 0;
-		if (ep2_callback)
-			ep2_callback(flag, size);
+		usbd_info.stats.ep2_map_ticks += OSCR - t0;
+		ep2_mapped = 0;
+	}
+	req->actual = ep2_len - ep2_remain;
+	req->status = flag;
+	ep2_len = 0;
+	ep2_unlink(req);
+
+	if (ep2_head && !core_kick_event.pending) {
+		wait = OSCR - ep2_head->queued;
+		usbd_info.stats.ep2_q_started++;
+		usbd_info.stats.ep2_q_wait_ticks += wait;
+		if (wait > usbd_info.stats.ep2_q_wait_max_ticks)
+			usbd_info.stats.ep2_q_wait_max_ticks = wait;
+		ep2_begin(ep2_head);
+	}
+
+	udc_complete(req);
+}
+
+/* fail everything waiting behind the current transfer, after a reset */
+static void ep2_flush(int flag)
+{
+	struct usb_request *req;
+
+	/* the transfer in progress, if any, is left to ep2_done() */
+	while ((req = ep2_len ? ep2_head->next : ep2_head)) {
+		ep2_unlink(req);
+		req->status = flag;
+		udc_complete(req);
+	}
+}
+
+/*
+ * ep2_queue()
+ * Start req now, or queue it behind the transfers already on ep2.
+ */
+int ep2_queue(struct usb_request *req)
+{
+	int flags;
+
+	if (req->length <= 0)
+		return -EINVAL;
+
+	local_irq_save(flags);
+	if (usbd_info.state != USB_STATE_CONFIGURED) {
+		local_irq_restore(flags);
+		return -ENODEV;
+	}
+	/* already queued: linking it again would loop the list */
+	if (req->status == -EINPROGRESS) {
+		local_irq_restore(flags);
+		return -EBUSY;
+	}
+
+	req->actual = 0;
+	req->status = -EINPROGRESS;
+	req->next = NULL;
+	req->queued = OSCR;
+	if (ep2_tail)
+		ep2_tail->next = req;
+	else
+		ep2_head = req;
+	ep2_tail = req;
+	ep2_depth++;
+
+	if (!ep2_len && core_kick_event.pending) {
+		usbd_info.stats.kick_held++;
+	} else if (!ep2_len) {
+		ep2_begin(req);
+	} else if (ep2_depth - 1 > usbd_info.stats.ep2_q_max_depth) {
+		usbd_info.stats.ep2_q_max_depth = ep2_depth - 1;
+	}
+	local_irq_restore(flags);
+	return 0;
+}
+
+/*
+ * ep2_dequeue()
+ * Cancel req. If it is on the wire the transfer is aborted and the
+ * next one started. The completion runs with -ECONNRESET.
+ */
+int ep2_dequeue(struct usb_request *req)
+{
+	struct usb_request *r;
+	int flags;
+
+	local_irq_save(flags);
+	for (r = ep2_head; r && r != req; r = r->next)
+		;
+	if (!r) {
+		local_irq_restore(flags);
+		return -EINVAL;
+	}
+
+	if (req == ep2_head && ep2_len) {
+		sa1100_clear_dma(dmachn_tx);
+		ep2_done(-ECONNRESET);
+	} else {
+		ep2_unlink(req);
+		req->status = -ECONNRESET;
+		udc_complete(req);
+	}
+	local_irq_restore(flags);
+	return 0;
+}
+
+static void ep2_legacy_complete(struct usb_request *req)
+{
+	struct ep2_legacy *w = (struct ep2_legacy *) req;
+	usb_callback_t callback = w->callback;
+
+	if (w->txbuf)
+		sa1100_usb_txbuf_put(w->txbuf);
+	w->busy = 0;
+	if (callback)
+		callback(req->status, req->actual);
+}
+
+/* wrap buf and callback in a request and queue it */
+static int ep2_submit(char *buf, int len, usb_callback_t callback, struct usb_txbuf *txbuf)
+{
+	struct ep2_legacy *w = NULL;
+	int flags;
+	int result;
+	int i;
+
+	local_irq_save(flags);
+	for (i = 0; i < EP2_LEGACY_REQS; i++) {
+		if (!ep2_legacy[i].busy) {
+			w = &ep2_legacy[i];
+			w->busy = 1;
+			break;
+		}
 	}
+	if (!w) {
+		usbd_info.stats.ep2_q_full++;
+		local_irq_restore(flags);
+		return -EBUSY;
+	}
+
+	w->callback = callback;
+	w->txbuf = txbuf;
+	w->req.buf = buf;
+	w->req.length = len;
+	w->req.dma = txbuf ? txbuf->dma : 0;
+	w->req.complete = ep2_legacy_complete;
+	w->req.context = NULL;
+	result = ep2_queue(&w->req);
+	if (result)
+		w->busy = 0;
+	local_irq_restore(flags);
+	return result;
+}
+
+/* the UDC is back from core_kicker(): start what queued meanwhile */
+void ep2_kick_done(void)
+{
+	if (!ep2_len && ep2_head)
+		ep2_begin(ep2_head);
 }
 
 int ep2_init(dma_regs_t *chn)
 {
 	dmachn_tx = chn;
 
-#ifdef SA1100_USB_DMA_WORKAROUND
 	tx_dma_regs = (tx_dma_regs_t *)dmachn_tx;
-#endif
 	sa1100_clear_dma(dmachn_tx);
+	ep2_flush(-EAGAIN);
 	ep2_done(-EAGAIN);
 	return 0;
 }
@@ -171,9 +562,73 @@ void ep2_reset(void)
 	
 	UDC_clear(Ser0UDCCS2, UDCCS2_FST);
 	sa1100_clear_dma(dmachn_tx);
+	ep2_flush(-EINTR);
 	ep2_done(-EINTR);
 }
 
+/*
+ * TPE/TUR: ep2_curdmapos still points at the failed packet, so starting
+ * again sends that packet. PIO and per-packet DMA keep their path; a
+ * ping-pong transfer drops to EP2_DMA_START for the rest of it.
+ */
+static void ep2_tx_error(int status)
+{
+	usbd_info.stats.ep2_tx_errors++;
+	if (ep2_pkt_retries < ep2_retry_pkt && ep2_xfer_retries < ep2_retry_xfer) {
+		ep2_pkt_retries++;
+		ep2_xfer_retries++;
+		usbd_info.stats.ep2_retries++;
+		PRINTKD("[%lu]usb_send: transmit error %x, retry %d\n", NOW_US(), status,
+			ep2_pkt_retries);
+		/* the other ping-pong descriptor may have preloaded the next
+		   packet already; finish this transfer one packet per TPC */
+		if (ep2_dma_cur == EP2_DMA_PINGPONG)
+			ep2_dma_cur = EP2_DMA_START;
+		ep2_start();
+		return;
+	}
+	usbd_info.stats.ep2_retry_exhausted++;
+	printk("usb_send: transmit error %x\n", status);
+	ep2_done(-EIO);
+}
+
+/*
+ * TPC in ping-pong mode: the next packet is already in the FIFO or on
+ * its way, so all that is left is setting its size and releasing TPC.
+ */
+static void ep2_pp_int(int status)
+{
+	if (!(status & UDCCS2_TPC)) {
+		UDC_flip(Ser0UDCCS2, UDCCS2_SST);
+		PRINTKD("usb_send: Not TPC: UDCCS2 = %x\n", status);
+		return;
+	}
+
+	if (status & (UDCCS2_TPE | UDCCS2_TUR)) {
+		UDC_flip(Ser0UDCCS2, UDCCS2_SST | UDCCS2_TPC);
+		sa1100_clear_dma(dmachn_tx);
+		ep2_tx_error(status);
+		return;
+	}
+
+	ep2_tx_ok();
+	ep2_curdmapos += ep2_curdmalen;
+	ep2_remain -= ep2_curdmalen;
+	if (ep2_remain == 0) {
+		UDC_flip(Ser0UDCCS2, UDCCS2_SST | UDCCS2_TPC);
+		ep2_tx_account();
+		ep2_done(0);
+		return;
+	}
+
+	ep2_curdmalen = tx_pktsize;
+	if (ep2_curdmalen > ep2_remain)
+		ep2_curdmalen = ep2_remain;
+	UDC_write( Ser0UDCIMP, ep2_curdmalen-1 );
+	UDC_flip(Ser0UDCCS2, UDCCS2_SST | UDCCS2_TPC);
+	ep2_pp_load();
+}
+
 void ep2_int_hndlr()
 {
 	int status = Ser0UDCCS2;
@@ -181,6 +636,11 @@ void ep2_int_hndlr()
 	if (Ser0UDCAR != portAddress[currentPort]) // check for stupid silicon bug.
 		Ser0UDCAR = portAddress[currentPort];
 
+	if (ep2_len && ep2_mode == EP2_TX_DMA && ep2_dma_cur == EP2_DMA_PINGPONG) {
+		ep2_pp_int(status);
+		return;
+	}
+
 	//UDC_flip(Ser0UDCCS2, UDCCS2_SST);
 	UDC_flip(Ser0UDCCS2, UDCCS2_SST | UDCCS2_TPC);
 
@@ -188,9 +648,9 @@ void ep2_int_hndlr()
 		sa1100_clear_dma(dmachn_tx);
 
 		if (status & (UDCCS2_TPE | UDCCS2_TUR)) {
-			printk("usb_send: transmit error %x\n", status);
-			ep2_done(-EIO);
+			ep2_tx_error(status);
 		} else {
+			ep2_tx_ok();
 #if 1 // 22Feb01ww/Oleg
 			ep2_curdmapos += ep2_curdmalen;
 			ep2_remain -= ep2_curdmalen;
@@ -202,6 +662,7 @@ void ep2_int_hndlr()
 			if (ep2_remain != 0) {
 				ep2_start();
 			} else {
+				ep2_tx_account();
 				ep2_done(0);
 			}
 		}
@@ -210,24 +671,98 @@ void ep2_int_hndlr()
 	}
 }
 
+/*
+ * sa1100_usb_send()
+ * Send buf on ep2. If a transfer is in progress the request is queued
+ * and started when those ahead of it are done; -EBUSY only when all
+ * EP2_LEGACY_REQS wrappers are in use.
+ */
 int sa1100_usb_send(char *buf, int len, usb_callback_t callback)
 {
-	int flags;
-	
-	if (usbd_info.state != USB_STATE_CONFIGURED)
-		return -ENODEV;
+	return ep2_submit(buf, len, callback, NULL);
+}
 
-	if (ep2_len)
-		return -EBUSY;
+/*
+ * sa1100_usb_txbuf_get()
+ * Take a buffer from the pool, NULL if they are all in use. Fill in
+ * ->data and pass it to sa1100_usb_send_buf(), or give it back with
+ * sa1100_usb_txbuf_put().
+ */
+struct usb_txbuf *sa1100_usb_txbuf_get(void)
+{
+	struct usb_txbuf *b = NULL;
+	int flags;
+	int i;
 
 	local_irq_save(flags);
-	ep2_buf = buf;
-	ep2_len = len;
-	ep2_dma = pci_map_single(NULL, buf, len, PCI_DMA_TODEVICE);
-	ep2_callback = callback;
-	ep2_remain = len;
-	ep2_curdmapos = ep2_dma;
-	ep2_start();
+	for (i = 0; i < EP2_POOL_BUFS; i++) {
+		if (ep2_pool_mem && !ep2_pool[i].busy) {
+			b = &ep2_pool[i];
+			b->busy = 1;
+			break;
+		}
+	}
+	if (!b)
+		usbd_info.stats.ep2_pool_exhausted++;
 	local_irq_restore(flags);
+	return b;
+}
+
+void sa1100_usb_txbuf_put(struct usb_txbuf *b)
+{
+	b->busy = 0;
+}
+
+/*
+ * sa1100_usb_send_buf()
+ * Like sa1100_usb_send() for a pool buffer, minus the mapping. The buffer
+ * goes back to the pool once the transfer is over, or right away if it
+ * can't be queued.
+ */
+int sa1100_usb_send_buf(struct usb_txbuf *b, int len, usb_callback_t callback)
+{
+	int result = -EINVAL;
+
+	if (len <= EP2_POOL_BUFSIZE)
+		result = ep2_submit(b->data, len, callback, b);
+	if (result)
+		sa1100_usb_txbuf_put(b);
+	return result;
+}
+
+int ep2_pool_init(void)
+{
+	char *tmp;
+	dma_addr_t dma;
+	__u32 t0;
+	int i;
+
+	ep2_pool_mem = consistent_alloc(GFP_KERNEL, EP2_POOL_BUFS * EP2_POOL_BUFSIZE, &ep2_pool_dma);
+	if (!ep2_pool_mem)
+		return -ENOMEM;
+	for (i = 0; i < EP2_POOL_BUFS; i++) {
+		ep2_pool[i].data = ep2_pool_mem + i * EP2_POOL_BUFSIZE;
+		ep2_pool[i].dma = ep2_pool_dma + i * EP2_POOL_BUFSIZE;
+		ep2_pool[i].busy = 0;
+	}
+
+	/* what a send through sa1100_usb_send() would have paid */
+	tmp = kmalloc(EP2_POOL_BUFSIZE, GFP_KERNEL);
+	if (tmp) {
+		t0 = OSCR;
+		for (i = 0; i < EP2_POOL_CALIBRATE; i++) {
+			dma = pci_map_single(NULL, tmp, EP2_POOL_BUFSIZE, PCI_DMA_TODEVICE);
+			pci_unmap_single(NULL, dma, EP2_POOL_BUFSIZE, PCI_DMA_TODEVICE);
+		}
+		usbd_info.stats.ep2_map_cost_ticks = (OSCR - t0) / EP2_POOL_CALIBRATE;
+		kfree(tmp);
+	}
 	return 0;
+}
+
+void ep2_pool_exit(void)
+{
+	if (ep2_pool_mem)
+		consistent_free(ep2_pool_mem, EP2_POOL_BUFS * EP2_POOL_BUFSIZE, ep2_pool_dma);
+	ep2_pool_mem = NULL;
 }
\ No newline at end of file